@@ -0,0 +1,407 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_http_clcache.h"
+
+static void rbtree_insert(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t **p;
+    for (;;)
+    {
+        if (node->key < temp->key)
+            p = &temp->left;
+        else if (node->key > temp->key)
+            p = &temp->right;
+        else
+        {
+            // crc32 collision, ordering by the couch key itself
+            ngx_http_clcache_node_s *cn = (ngx_http_clcache_node_s *)node;
+            ngx_http_clcache_node_s *cnt = (ngx_http_clcache_node_s *)temp;
+            p = ngx_memn2cmp(cn->data, cnt->data, cn->key_len, cnt->key_len) < 0
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel)
+            break;
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_http_clcache_node_s *find_locked(ngx_http_clcache_s *cache, ngx_str_t *key, uint32_t hash)
+{
+    ngx_rbtree_node_t *node = cache->sh->rbtree.root;
+    ngx_rbtree_node_t *sentinel = cache->sh->rbtree.sentinel;
+    while (node != sentinel)
+    {
+        if (hash != node->key)
+        {
+            node = hash < node->key ? node->left : node->right;
+            continue;
+        }
+
+        ngx_http_clcache_node_s *cn = (ngx_http_clcache_node_s *)node;
+        ngx_int_t rc = ngx_memn2cmp(key->data, cn->data, key->len, cn->key_len);
+        if (rc == 0)
+            return cn;
+        node = rc < 0 ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+static u_char *sketch_counter(ngx_http_clcache_sh_s *sh, uint32_t hash, ngx_uint_t row)
+{
+    // Multiplicative hashing of the crc32, a different odd factor per row
+    static const uint32_t seeds[CLC_SKETCH_DEPTH] = {
+        0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f
+    };
+
+    uint32_t index = (uint32_t)(hash * seeds[row]) >> (32 - sh->sketch_bits);
+    return &sh->sketch[(row << sh->sketch_bits) + index];
+}
+
+static void sketch_add_locked(ngx_http_clcache_s *cache, uint32_t hash, ngx_uint_t n)
+{
+    ngx_http_clcache_sh_s *sh = cache->sh;
+    ngx_uint_t row, i;
+    for (row = 0; row < CLC_SKETCH_DEPTH; ++row)
+    {
+        u_char *counter = sketch_counter(sh, hash, row);
+        *counter = ngx_min(*counter + n, CLC_SKETCH_MAX);
+    }
+
+    // Aging: halving all counters lets past hot keys make room for new ones
+    sh->sketch_accesses += n;
+    if (sh->sketch_accesses < (CLC_SKETCH_SAMPLE << sh->sketch_bits))
+        return;
+
+    for (i = 0; i < (CLC_SKETCH_DEPTH << sh->sketch_bits); ++i)
+        sh->sketch[i] >>= 1;
+    sh->sketch_accesses /= 2;
+}
+
+static ngx_uint_t sketch_estimate_locked(ngx_http_clcache_s *cache, uint32_t hash)
+{
+    ngx_uint_t row, estimate = CLC_SKETCH_MAX;
+    for (row = 0; row < CLC_SKETCH_DEPTH; ++row)
+        estimate = ngx_min(estimate, *sketch_counter(cache->sh, hash, row));
+
+    return estimate;
+}
+
+#if (NGX_HTTP_COUCHLOOKUP_LZ4)
+static u_char *compress(u_char *data, size_t len, size_t *packed_len)
+{
+    if (len < CLC_COMPRESS_MIN_SIZE || len > LZ4_MAX_INPUT_SIZE)
+        return NULL;
+
+    int bound = LZ4_compressBound((int)len);
+    u_char *packed = ngx_alloc(bound, ngx_cycle->log);
+    if (packed == NULL)
+        return NULL;
+
+    int n = LZ4_compress_default((char *)data, (char *)packed, (int)len, bound);
+    if (n <= 0 || (size_t)n > len - len / 8)
+    {
+        ngx_free(packed);
+        return NULL;
+    }
+
+    *packed_len = n;
+    return packed;
+}
+
+static ngx_int_t decompress(ngx_pool_t *pool, ngx_http_clcache_doc_s *doc, size_t raw_len)
+{
+    u_char *raw = ngx_pnalloc(pool, raw_len);
+    if (raw == NULL)
+        return NGX_ERROR;
+
+    if (LZ4_decompress_safe((char *)doc->data, (char *)raw, (int)doc->len, (int)raw_len)
+        != (int)raw_len)
+        return NGX_ERROR;
+
+    ngx_pfree(pool, doc->data);
+    doc->data = raw;
+    doc->len = raw_len;
+
+    return NGX_OK;
+}
+#endif
+
+static void delete_locked(ngx_http_clcache_s *cache, ngx_http_clcache_node_s *cn)
+{
+    ngx_queue_remove(&cn->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &cn->node);
+    ngx_slab_free_locked(cache->shpool, cn);
+}
+
+ngx_int_t ngx_http_clcache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_clcache_s *ocache = data; // previous cycle's zone, on reload
+    ngx_http_clcache_s *cache = shm_zone->data;
+    if (ocache != NULL)
+    {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    if (shm_zone->shm.exists)
+    {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool, sizeof (ngx_http_clcache_sh_s));
+    if (cache->sh == NULL)
+        return NGX_ERROR;
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel, rbtree_insert);
+    ngx_queue_init(&cache->sh->lru);
+    ngx_memzero((void *)cache->sh->generations, sizeof (cache->sh->generations));
+
+    // As many counters per row as entries of a typical size fit in the zone
+    size_t capacity = shm_zone->shm.size / CLC_SKETCH_ENTRY_SIZE;
+    ngx_uint_t bits = CLC_SKETCH_MIN_BITS;
+    while (bits < CLC_SKETCH_MAX_BITS && ((size_t)1 << bits) < capacity)
+        ++bits;
+    cache->sh->sketch = ngx_slab_alloc(cache->shpool, CLC_SKETCH_DEPTH << bits);
+    if (cache->sh->sketch == NULL)
+        return NGX_ERROR;
+    ngx_memzero(cache->sh->sketch, CLC_SKETCH_DEPTH << bits);
+    cache->sh->sketch_bits = bits;
+    cache->sh->sketch_accesses = 0;
+
+    size_t len = sizeof (" in couchlookup cache zone \"\"") + shm_zone->shm.name.len;
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL)
+        return NGX_ERROR;
+    ngx_sprintf(cache->shpool->log_ctx, " in couchlookup cache zone \"%V\"%Z",
+        &shm_zone->shm.name);
+
+    // Allocation failures are expected when the zone is full, entries get evicted
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+ngx_http_clcache_status_e ngx_http_clcache_lookup(ngx_shm_zone_t *shm_zone,
+    ngx_pool_t *pool, ngx_str_t *key, ngx_http_clcache_doc_s *doc)
+{
+    ngx_http_clcache_s *cache = shm_zone->data;
+    ngx_http_clcache_status_e rc = CLC_MISS;
+    uint32_t hash = ngx_crc32_short(key->data, key->len);
+    size_t raw_len = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    sketch_add_locked(cache, hash, 1);
+
+    ngx_http_clcache_node_s *cn = find_locked(cache, key, hash);
+    if (cn == NULL)
+        goto done;
+
+    // Copying out, the entry can be evicted by another worker once unlocked
+    doc->data = ngx_pnalloc(pool, cn->doc_len);
+    if (doc->data == NULL)
+        goto done;
+    ngx_memcpy(doc->data, cn->data + cn->key_len, cn->doc_len);
+    doc->len = cn->doc_len;
+    raw_len = cn->raw_len;
+    doc->cas = cn->cas;
+    doc->expire = cn->expire;
+    doc->valid = cn->valid;
+
+    ngx_queue_remove(&cn->queue);
+    ngx_queue_insert_head(&cache->sh->lru, &cn->queue);
+
+    rc = cn->expire > ngx_time() ? CLC_HIT : CLC_STALE;
+
+done:
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (rc == CLC_MISS || raw_len == 0)
+        return rc;
+
+#if (NGX_HTTP_COUCHLOOKUP_LZ4)
+    if (decompress(pool, doc, raw_len) == NGX_OK)
+        return rc;
+#endif
+
+    return CLC_MISS; // fetched again, and stored over the unreadable entry
+}
+
+ngx_int_t ngx_http_clcache_store(ngx_shm_zone_t *shm_zone, ngx_str_t *key,
+    u_char *data, size_t len, uint64_t cas, time_t valid, ngx_atomic_uint_t *generation)
+{
+    if (key->len > 0xffff)
+        return NGX_DECLINED;
+
+    ngx_http_clcache_s *cache = shm_zone->data;
+    uint32_t hash = ngx_crc32_short(key->data, key->len);
+    size_t raw_len = 0;
+    u_char *packed = NULL;
+
+#if (NGX_HTTP_COUCHLOOKUP_LZ4)
+    size_t packed_len;
+    if (cache->compress && (packed = compress(data, len, &packed_len)) != NULL)
+    {
+        raw_len = len;
+        data = packed;
+        len = packed_len;
+    }
+#endif
+
+    size_t size = offsetof(ngx_http_clcache_node_s, data) + key->len + len;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    ngx_http_clcache_node_s *cn = find_locked(cache, key, hash);
+    ngx_atomic_t *gen = &cache->sh->generations[hash % CLC_GENERATIONS];
+    // Only copies of a replaced revision are outdated: keys stored for the first
+    // time (or not admitted) leave the other keys of the generation alone
+    if (cn != NULL && cn->cas != cas)
+        ngx_atomic_fetch_add(gen, 1);
+    if (generation != NULL)
+        *generation = *gen;
+
+    // New revisions of cached keys are always admitted
+    ngx_flag_t admitted = cn != NULL;
+    if (cn != NULL)
+        delete_locked(cache, cn);
+
+    cn = ngx_slab_alloc_locked(cache->shpool, size);
+
+    ngx_uint_t estimate = admitted ? 0 : sketch_estimate_locked(cache, hash);
+    unsigned tries;
+    for (tries = 0; cn == NULL && tries < CLC_EVICT_TRIES; ++tries)
+    {
+        if (ngx_queue_empty(&cache->sh->lru))
+            break;
+
+        ngx_queue_t *q = ngx_queue_last(&cache->sh->lru);
+        ngx_http_clcache_node_s *victim = ngx_queue_data(q, ngx_http_clcache_node_s, queue);
+        if (!admitted && estimate <= sketch_estimate_locked(cache, victim->node.key))
+            break;
+
+        delete_locked(cache, victim);
+        cn = ngx_slab_alloc_locked(cache->shpool, size);
+    }
+
+    if (cn == NULL)
+    {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        if (packed != NULL)
+            ngx_free(packed);
+        return NGX_DECLINED;
+    }
+
+    cn->node.key = hash;
+    cn->cas = cas;
+    cn->expire = ngx_time() + valid;
+    cn->valid = valid;
+    cn->doc_len = len;
+    cn->raw_len = raw_len;
+    cn->key_len = (u_short)key->len;
+    ngx_memcpy(cn->data, key->data, key->len);
+    ngx_memcpy(cn->data + key->len, data, len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+    ngx_queue_insert_head(&cache->sh->lru, &cn->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (packed != NULL)
+        ngx_free(packed);
+
+    return NGX_OK;
+}
+
+ngx_int_t ngx_http_clcache_revalidate(ngx_shm_zone_t *shm_zone, ngx_str_t *key,
+    uint64_t cas)
+{
+    ngx_http_clcache_s *cache = shm_zone->data;
+    ngx_int_t rc = NGX_DECLINED;
+    uint32_t hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    ngx_http_clcache_node_s *cn = find_locked(cache, key, hash);
+    if (cn != NULL && cn->cas == cas)
+    {
+        cn->expire = ngx_time() + cn->valid;
+        rc = NGX_OK;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+void ngx_http_clcache_touch(ngx_shm_zone_t *shm_zone, ngx_str_t *key, ngx_uint_t hits)
+{
+    ngx_http_clcache_s *cache = shm_zone->data;
+    uint32_t hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    sketch_add_locked(cache, hash, hits);
+
+    ngx_http_clcache_node_s *cn = find_locked(cache, key, hash);
+    if (cn != NULL)
+    {
+        ngx_queue_remove(&cn->queue);
+        ngx_queue_insert_head(&cache->sh->lru, &cn->queue);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+ngx_flag_t ngx_http_clcache_fresh(ngx_shm_zone_t *shm_zone, ngx_str_t *key)
+{
+    ngx_http_clcache_s *cache = shm_zone->data;
+    uint32_t hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    ngx_http_clcache_node_s *cn = find_locked(cache, key, hash);
+    ngx_flag_t fresh = cn != NULL && cn->expire > ngx_time();
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return fresh;
+}
+
+void ngx_http_clcache_remove(ngx_shm_zone_t *shm_zone, ngx_str_t *key)
+{
+    ngx_http_clcache_s *cache = shm_zone->data;
+    uint32_t hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    ngx_http_clcache_node_s *cn = find_locked(cache, key, hash);
+    if (cn != NULL)
+    {
+        ngx_atomic_fetch_add(&cache->sh->generations[hash % CLC_GENERATIONS], 1);
+        delete_locked(cache, cn);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+ngx_atomic_uint_t ngx_http_clcache_generation(ngx_shm_zone_t *shm_zone, ngx_str_t *key)
+{
+    ngx_http_clcache_s *cache = shm_zone->data;
+    uint32_t hash = ngx_crc32_short(key->data, key->len);
+
+    return cache->sh->generations[hash % CLC_GENERATIONS];
+}
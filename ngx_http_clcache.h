@@ -0,0 +1,152 @@
+#ifndef NGX_HTTP_CLCACHE_H
+# define NGX_HTTP_CLCACHE_H
+
+# include <ngx_core.h>
+# if (NGX_HTTP_COUCHLOOKUP_LZ4)
+#  include <lz4.h>
+# endif
+
+/**
+ * @brief Number of LRU entries evicted before giving up on a store
+ */
+# define CLC_EVICT_TRIES (16)
+
+/**
+ * @brief Number of generation counters, keys are spread over them by hash
+ */
+# define CLC_GENERATIONS (1024)
+
+/**
+ * @brief Documents are only kept compressed from this size, and if it saves an eighth
+ */
+# define CLC_COMPRESS_MIN_SIZE (512)
+
+/**
+ * @brief Frequency sketch (count-min) used for admission, see ngx_http_clcache_store
+ * @details Rows are sized when the zone is created, a counter per entry the
+ *  zone can hold: small sketches saturate and cannot tell keys apart.
+ */
+# define CLC_SKETCH_DEPTH (4)
+# define CLC_SKETCH_MIN_BITS (10) // counters per row, log2
+# define CLC_SKETCH_MAX_BITS (24)
+# define CLC_SKETCH_ENTRY_SIZE (256) // bytes, to estimate how many entries the zone holds
+# define CLC_SKETCH_MAX (15) // counters saturate, only relative hotness matters
+# define CLC_SKETCH_SAMPLE (10) // accesses between two agings, per counter of a row
+
+/**
+ * @brief Cached document, stored in the shared memory zone
+ * @details The key is stored first in `data`, followed by the document.
+ */
+typedef struct {
+    ngx_rbtree_node_t node; // node.key is the crc32 of the couch key
+    ngx_queue_t queue; // LRU queue link
+    uint64_t cas; // couchbase CAS of the cached revision
+    time_t expire; // entry needs revalidation past this time
+    time_t valid; // lifetime, extended by as much on revalidation
+    size_t doc_len; // stored size, compressed or not
+    size_t raw_len; // size once decompressed, 0 when stored as is
+    u_short key_len;
+    u_char data[1];
+} ngx_http_clcache_node_s;
+
+/**
+ * @brief Shared part of the cache, allocated in the zone
+ */
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t lru; // most recently used entries at the head
+    ngx_atomic_t generations[CLC_GENERATIONS]; // bumped when a document changes
+    u_char *sketch; // access frequencies, CLC_SKETCH_DEPTH rows of 2^sketch_bits counters
+    ngx_uint_t sketch_bits;
+    ngx_uint_t sketch_accesses; // counted since the last aging
+} ngx_http_clcache_sh_s;
+
+/**
+ * @brief Cache zone context, stored in shm_zone->data
+ */
+typedef struct {
+    ngx_http_clcache_sh_s *sh;
+    ngx_slab_pool_t *shpool;
+    ngx_flag_t compress; // documents are stored LZ4 compressed, needs NGX_HTTP_COUCHLOOKUP_LZ4
+} ngx_http_clcache_s;
+
+/**
+ * @brief Document copied out of the cache
+ */
+typedef struct {
+    u_char *data;
+    size_t len;
+    uint64_t cas;
+    time_t expire;
+    time_t valid;
+} ngx_http_clcache_doc_s;
+
+/**
+ * @brief Enum of lookup statuses
+ */
+typedef enum {
+    CLC_MISS,
+    CLC_HIT,
+    CLC_STALE // present but expired, needs revalidation against its CAS
+} ngx_http_clcache_status_e;
+
+/**
+ * @brief Initializes the shared memory zone (ngx_shm_zone_t init callback)
+ */
+ngx_int_t ngx_http_clcache_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+/**
+ * @brief Looks up a document, copying it into `pool` when found
+ * @details Counts the access in the frequency sketch, even on misses.
+ *  Compressed documents are decompressed once the zone is unlocked.
+ */
+ngx_http_clcache_status_e ngx_http_clcache_lookup(ngx_shm_zone_t *shm_zone,
+    ngx_pool_t *pool, ngx_str_t *key, ngx_http_clcache_doc_s *doc);
+
+/**
+ * @brief Stores (or replaces) a document, evicting LRU entries if needed
+ * @details A new key only evicts LRU entries it was accessed more often than
+ *  (TinyLFU admission, without window), one-off keys cannot flush the cache.
+ *  Bumps the generation of the key if another revision was cached, its value
+ *  is set in `generation` (can be NULL). Compressed before locking
+ *  the zone if it compresses documents.
+ * @returns NGX_OK if stored, NGX_DECLINED if not admitted or too large
+ */
+ngx_int_t ngx_http_clcache_store(ngx_shm_zone_t *shm_zone, ngx_str_t *key,
+    u_char *data, size_t len, uint64_t cas, time_t valid, ngx_atomic_uint_t *generation);
+
+/**
+ * @brief Returns the generation of a key, without locking
+ * @details Copies of documents made before a change have an older generation.
+ */
+ngx_atomic_uint_t ngx_http_clcache_generation(ngx_shm_zone_t *shm_zone, ngx_str_t *key);
+
+/**
+ * @brief Extends the lifetime of an entry if its CAS is still `cas`
+ * @details The entry is valid again for as long as it was stored for.
+ * @returns NGX_OK if the entry was revalidated, NGX_DECLINED otherwise
+ */
+ngx_int_t ngx_http_clcache_revalidate(ngx_shm_zone_t *shm_zone, ngx_str_t *key,
+    uint64_t cas);
+
+/**
+ * @brief Accounts accesses served in front of the zone, e.g. by L1 tables
+ * @details Counted in the frequency sketch, and the entry (if any) becomes
+ *  the most recently used one.
+ * @param hits Number of accesses
+ */
+void ngx_http_clcache_touch(ngx_shm_zone_t *shm_zone, ngx_str_t *key, ngx_uint_t hits);
+
+/**
+ * @brief Checks whether a key is cached and not expired, without copying it
+ * @details Not counted as an access, the lookup that follows is.
+ */
+ngx_flag_t ngx_http_clcache_fresh(ngx_shm_zone_t *shm_zone, ngx_str_t *key);
+
+/**
+ * @brief Removes an entry, bumping the generation of the key if it was cached
+ */
+void ngx_http_clcache_remove(ngx_shm_zone_t *shm_zone, ngx_str_t *key);
+
+#endif // !NGX_HTTP_CLCACHE_H
@@ -0,0 +1,138 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_http_clcache_l1.h"
+
+static void record_free(ngx_http_clcache_l1_record_s *rec)
+{
+    ngx_free(rec->block);
+    rec->block = NULL;
+}
+
+static void rebase(ngx_str_t *values, ngx_uint_t nvalues, u_char *from, u_char *to)
+{
+    ngx_uint_t i;
+    for (i = 0; i < nvalues; ++i)
+        if (values[i].data != NULL)
+            values[i].data = to + (values[i].data - from);
+}
+
+ngx_http_clcache_l1_s *ngx_http_clcache_l1_create(ngx_pool_t *pool, ngx_uint_t entries)
+{
+    ngx_http_clcache_l1_s *l1 = ngx_palloc(pool, sizeof (ngx_http_clcache_l1_s));
+    if (l1 == NULL)
+        return NULL;
+
+    ngx_uint_t nsets = 1;
+    while (nsets * CL1_WAYS < entries)
+        nsets <<= 1;
+
+    l1->records = ngx_pcalloc(pool, sizeof (ngx_http_clcache_l1_record_s) * nsets * CL1_WAYS);
+    if (l1->records == NULL)
+        return NULL;
+    l1->mask = nsets - 1;
+    l1->tick = 0;
+
+    return l1;
+}
+
+ngx_str_t *ngx_http_clcache_l1_get(ngx_http_clcache_l1_s *l1, ngx_pool_t *pool,
+    ngx_str_t *key, ngx_uint_t nvalues, ngx_atomic_uint_t generation, ngx_uint_t *hits)
+{
+    *hits = 0;
+
+    uint32_t hash = ngx_crc32_short(key->data, key->len);
+    ngx_http_clcache_l1_record_s *set = &l1->records[(hash & l1->mask) * CL1_WAYS];
+    size_t values_size = sizeof (ngx_str_t) * nvalues;
+
+    unsigned w;
+    for (w = 0; w < CL1_WAYS; ++w)
+    {
+        ngx_http_clcache_l1_record_s *rec = &set[w];
+        if (rec->block == NULL || rec->hash != hash
+            || ngx_memn2cmp(rec->block + values_size, key->data, rec->key_len, key->len) != 0)
+            continue;
+
+        // Changed in the shared zone since it was copied, or due for revalidation
+        if (rec->generation != generation || rec->expire <= ngx_time())
+        {
+            record_free(rec);
+            return NULL;
+        }
+
+        u_char *copy = ngx_palloc(pool, rec->size);
+        if (copy == NULL)
+            return NULL;
+        ngx_memcpy(copy, rec->block, rec->size);
+        rebase((ngx_str_t *)copy, nvalues, rec->block, copy);
+
+        rec->used = ++l1->tick;
+
+        // Batched, the zone would otherwise see hot keys as rarely looked up
+        if (++rec->hits >= CL1_REPORT_HITS)
+        {
+            *hits = rec->hits;
+            rec->hits = 0;
+        }
+
+        return (ngx_str_t *)copy;
+    }
+
+    return NULL;
+}
+
+void ngx_http_clcache_l1_put(ngx_http_clcache_l1_s *l1, ngx_log_t *log, ngx_str_t *key,
+    ngx_str_t *values, ngx_uint_t nvalues, ngx_atomic_uint_t generation, time_t expire)
+{
+    if (key->len > 0xffff)
+        return;
+
+    uint32_t hash = ngx_crc32_short(key->data, key->len);
+    ngx_http_clcache_l1_record_s *set = &l1->records[(hash & l1->mask) * CL1_WAYS];
+    size_t values_size = sizeof (ngx_str_t) * nvalues;
+
+    // Same key or free record first, least recently used one otherwise
+    ngx_http_clcache_l1_record_s *victim = &set[0];
+    unsigned w;
+    for (w = 0; w < CL1_WAYS; ++w)
+    {
+        ngx_http_clcache_l1_record_s *rec = &set[w];
+        if (rec->block != NULL && rec->hash == hash
+            && ngx_memn2cmp(rec->block + values_size, key->data, rec->key_len, key->len) == 0)
+        {
+            victim = rec;
+            break;
+        }
+        if (victim->block != NULL && (rec->block == NULL || rec->used < victim->used))
+            victim = rec;
+    }
+
+    size_t size = values_size + key->len;
+    ngx_uint_t i;
+    for (i = 0; i < nvalues; ++i)
+        size += values[i].len;
+
+    u_char *block = ngx_alloc(size, log);
+    if (block == NULL)
+        return;
+
+    ngx_str_t *copy = (ngx_str_t *)block;
+    u_char *p = ngx_cpymem(block + values_size, key->data, key->len);
+    for (i = 0; i < nvalues; ++i)
+    {
+        copy[i].len = values[i].len;
+        copy[i].data = values[i].data == NULL ? NULL : p;
+        p = ngx_cpymem(p, values[i].data, values[i].len);
+    }
+
+    if (victim->block != NULL)
+        record_free(victim);
+
+    victim->block = block;
+    victim->size = size;
+    victim->hash = hash;
+    victim->key_len = (u_short)key->len;
+    victim->generation = generation;
+    victim->expire = expire;
+    victim->used = ++l1->tick;
+    victim->hits = 0;
+}
@@ -0,0 +1,64 @@
+#ifndef NGX_HTTP_CLCACHE_L1_H
+# define NGX_HTTP_CLCACHE_L1_H
+
+# include <ngx_core.h>
+
+/**
+ * @brief Number of records per set, a key can only be stored in its set
+ */
+# define CL1_WAYS (4)
+
+/**
+ * @brief Hits of a record between two reports to the shared zone
+ */
+# define CL1_REPORT_HITS (16)
+
+/**
+ * @brief Variable set of a key, copied in the worker's memory
+ * @details `block` holds the values array, then the key, then the value bytes.
+ *  Values point into the block.
+ */
+typedef struct {
+    u_char *block; // NULL when the record is free
+    size_t size;
+    uint32_t hash; // crc32 of the couch key
+    u_short key_len;
+    ngx_atomic_uint_t generation; // generation of the key in the shared zone
+    time_t expire;
+    ngx_uint_t used; // tick of the last hit, least recently used record is replaced
+    ngx_uint_t hits; // not reported to the shared zone yet
+} ngx_http_clcache_l1_record_s;
+
+/**
+ * @brief Per-worker table of variable sets, in front of the shared zone
+ * @details Only ever accessed by the worker owning it: no locking at all.
+ */
+typedef struct {
+    ngx_http_clcache_l1_record_s *records; // nsets * CL1_WAYS records
+    ngx_uint_t mask; // nsets - 1, nsets is a power of two
+    ngx_uint_t tick;
+} ngx_http_clcache_l1_s;
+
+/**
+ * @brief Allocates a table of at least `entries` records
+ * @returns Table allocated in `pool`, NULL on allocation failure
+ */
+ngx_http_clcache_l1_s *ngx_http_clcache_l1_create(ngx_pool_t *pool, ngx_uint_t entries);
+
+/**
+ * @brief Looks up the variable set of a key, copying it into `pool`
+ * @details Records of another generation or expired are dropped.
+ * @param hits Set to the hits to report to the shared zone (see
+ *  ngx_http_clcache_touch) every CL1_REPORT_HITS hits, 0 otherwise
+ * @returns Array of `nvalues` values allocated in `pool`, NULL if not found
+ */
+ngx_str_t *ngx_http_clcache_l1_get(ngx_http_clcache_l1_s *l1, ngx_pool_t *pool,
+    ngx_str_t *key, ngx_uint_t nvalues, ngx_atomic_uint_t generation, ngx_uint_t *hits);
+
+/**
+ * @brief Stores the variable set of a key, replacing the LRU record of its set
+ */
+void ngx_http_clcache_l1_put(ngx_http_clcache_l1_s *l1, ngx_log_t *log, ngx_str_t *key,
+    ngx_str_t *values, ngx_uint_t nvalues, ngx_atomic_uint_t generation, time_t expire);
+
+#endif // !NGX_HTTP_CLCACHE_L1_H
@@ -0,0 +1,101 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_http_clhedge.h"
+
+static ngx_uint_t bucket(uint64_t time_us)
+{
+    ngx_uint_t b = 0;
+    for (time_us >>= CLH_BUCKET_MIN_BITS; time_us > 0 && b < CLH_BUCKETS - 1; time_us >>= 1)
+        ++b;
+
+    return b;
+}
+
+// Lock-free, the counter can be incremented meanwhile
+static void halve(ngx_atomic_t *a)
+{
+    ngx_atomic_uint_t old;
+    do
+    {
+        old = *a;
+    }
+    while (!ngx_atomic_cmp_set(a, old, old / 2));
+}
+
+ngx_http_clhedge_s *ngx_http_clhedge_create(ngx_pool_t *pool, ngx_msec_t delay, ngx_uint_t budget)
+{
+    ngx_http_clhedge_s *h = ngx_pcalloc(pool, sizeof (ngx_http_clhedge_s));
+    if (h == NULL)
+        return NULL;
+
+    h->delay = delay;
+    h->budget = budget;
+
+    return h;
+}
+
+uint32_t ngx_http_clhedge_delay(ngx_http_clhedge_s *h)
+{
+    if (h->delay > 0)
+        return h->delay * 1000;
+
+    ngx_atomic_uint_t total = 0;
+    ngx_uint_t b;
+    for (b = 0; b < CLH_BUCKETS; ++b)
+        total += h->hist[b];
+    if (total < CLH_MIN_SAMPLES)
+        return 0;
+
+    ngx_atomic_uint_t count = 0;
+    for (b = 0; b < CLH_BUCKETS - 1; ++b)
+    {
+        count += h->hist[b];
+        if (count * 100 >= total * CLH_QUANTILE)
+            break;
+    }
+
+    return (uint32_t)1 << (b + CLH_BUCKET_MIN_BITS);
+}
+
+void ngx_http_clhedge_count(ngx_http_clhedge_s *h, ngx_uint_t n)
+{
+    ngx_atomic_fetch_add(&h->lookups, n);
+}
+
+ngx_flag_t ngx_http_clhedge_reserve(ngx_http_clhedge_s *h)
+{
+    // Taken first and given back if over: concurrent reservations see each other
+    ngx_atomic_uint_t hedges = ngx_atomic_fetch_add(&h->hedges, 1) + 1;
+    if (hedges * 100 <= h->budget * h->lookups)
+        return 1;
+
+    ngx_http_clhedge_release(h);
+    return 0;
+}
+
+void ngx_http_clhedge_release(ngx_http_clhedge_s *h)
+{
+    // Never below 0: the reservation can predate an aging
+    ngx_atomic_uint_t old;
+    do
+    {
+        old = h->hedges;
+    }
+    while (old > 0 && !ngx_atomic_cmp_set(&h->hedges, old, old - 1));
+}
+
+void ngx_http_clhedge_observe(ngx_http_clhedge_s *h, uint64_t time_us)
+{
+    ngx_atomic_fetch_add(&h->hist[bucket(time_us)], 1);
+
+    // Aging: only the thread reaching the window halves the counters
+    if (ngx_atomic_fetch_add(&h->samples, 1) + 1 != CLH_WINDOW)
+        return;
+
+    ngx_uint_t b;
+    for (b = 0; b < CLH_BUCKETS; ++b)
+        halve(&h->hist[b]);
+    halve(&h->lookups);
+    halve(&h->hedges);
+    ngx_atomic_fetch_add(&h->samples, -CLH_WINDOW); // round trips observed meanwhile count
+}
@@ -0,0 +1,73 @@
+#ifndef NGX_HTTP_CLHEDGE_H
+# define NGX_HTTP_CLHEDGE_H
+
+# include <ngx_core.h>
+
+/**
+ * @brief Histogram of round trips, log2 buckets of microseconds
+ * @details Bucket 0 holds round trips under 128us, bucket `b` those under
+ *  2^(b+7)us. The last one holds everything from 2^23us (about 8.4s) on, its
+ *  bound 2^24us (about 16.7s) is only a delay, not a limit.
+ */
+# define CLH_BUCKETS (18)
+# define CLH_BUCKET_MIN_BITS (7)
+
+# define CLH_WINDOW (8192) // round trips between two agings
+# define CLH_MIN_SAMPLES (256) // no derived delay before this many round trips
+# define CLH_QUANTILE (95)
+
+/**
+ * @brief Hedging policy of a location, in a worker
+ * @details Updated by the worker and its thread pool threads: counters are
+ *  atomic, and halved together once in a while (compare-and-swap, increments
+ *  made meanwhile are kept) so that old round trips age out.
+ */
+typedef struct {
+    ngx_msec_t delay; // fixed delay, 0 to derive it from the observed quantile
+    ngx_uint_t budget; // hedged lookups, in percent of all lookups
+    ngx_atomic_t lookups;
+    ngx_atomic_t hedges;
+    ngx_atomic_t samples;
+    ngx_atomic_t hist[CLH_BUCKETS];
+} ngx_http_clhedge_s;
+
+/**
+ * @brief Allocates a hedging policy
+ * @returns Policy allocated in `pool`, NULL on allocation failure
+ */
+ngx_http_clhedge_s *ngx_http_clhedge_create(ngx_pool_t *pool, ngx_msec_t delay, ngx_uint_t budget);
+
+/**
+ * @brief Returns the time after which lookups are hedged
+ * @details Derived delays are the upper bound of the bucket of the quantile:
+ *  a bit late, never early.
+ * @returns Delay in microseconds, 0 while too few round trips were observed
+ */
+uint32_t ngx_http_clhedge_delay(ngx_http_clhedge_s *h);
+
+/**
+ * @brief Accounts lookups about to be sent, the base of the budget
+ * @param n Number of lookups
+ */
+void ngx_http_clhedge_count(ngx_http_clhedge_s *h, ngx_uint_t n);
+
+/**
+ * @brief Reserves the budget of a hedged request, right before it is sent
+ * @details The reservation is atomic: concurrent batches cannot overrun the
+ *  budget, whatever their size.
+ * @returns 1 if the request can be sent, 0 if the budget is spent
+ */
+ngx_flag_t ngx_http_clhedge_reserve(ngx_http_clhedge_s *h);
+
+/**
+ * @brief Gives back the budget of a hedged request which could not be sent
+ */
+void ngx_http_clhedge_release(ngx_http_clhedge_s *h);
+
+/**
+ * @brief Accounts the round trip of a lookup, once complete
+ * @param time_us Round trip of the lookup
+ */
+void ngx_http_clhedge_observe(ngx_http_clhedge_s *h, uint64_t time_us);
+
+#endif // !NGX_HTTP_CLHEDGE_H
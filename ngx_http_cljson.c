@@ -0,0 +1,239 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_http_cljson.h"
+
+static ngx_int_t hex4(u_char *p, u_char *end)
+{
+    if (end - p < 4)
+        return -1;
+
+    ngx_int_t cp = ngx_hextoi(p, 4);
+    return cp == NGX_ERROR ? -1 : cp;
+}
+
+static u_char *utf8(u_char *dst, uint32_t cp)
+{
+    if (cp < 0x80)
+        *dst++ = (u_char)cp;
+    else if (cp < 0x800)
+    {
+        *dst++ = (u_char)(0xc0 | (cp >> 6));
+        *dst++ = (u_char)(0x80 | (cp & 0x3f));
+    }
+    else if (cp < 0x10000)
+    {
+        *dst++ = (u_char)(0xe0 | (cp >> 12));
+        *dst++ = (u_char)(0x80 | ((cp >> 6) & 0x3f));
+        *dst++ = (u_char)(0x80 | (cp & 0x3f));
+    }
+    else
+    {
+        *dst++ = (u_char)(0xf0 | (cp >> 18));
+        *dst++ = (u_char)(0x80 | ((cp >> 12) & 0x3f));
+        *dst++ = (u_char)(0x80 | ((cp >> 6) & 0x3f));
+        *dst++ = (u_char)(0x80 | (cp & 0x3f));
+    }
+
+    return dst;
+}
+
+/**
+ * Decodes the escape sequence at `p` (a backslash) into `*dst`, returns the
+ * end of the sequence. Invalid sequences are copied as is.
+ */
+static u_char *unescape(u_char *p, u_char *end, u_char **dst)
+{
+    if (end - p < 2)
+    {
+        *(*dst)++ = *p;
+        return p + 1;
+    }
+
+    // Control characters (\b, \n, \u0000, etc.) stay escaped: values reach
+    // response headers, where a raw CR, LF or NUL could split or truncate them
+    switch (p[1])
+    {
+    case '"': case '\\': case '/': *(*dst)++ = p[1]; return p + 2;
+    case 'u': break;
+    default:
+        *(*dst)++ = p[0];
+        *(*dst)++ = p[1];
+        return p + 2;
+    }
+
+    ngx_int_t cp = hex4(p + 2, end);
+    if (cp < 0)
+    {
+        *(*dst)++ = p[0];
+        *(*dst)++ = p[1];
+        return p + 2;
+    }
+    if (cp < CLJ_MIN_DECODED_CHAR)
+    {
+        *dst = ngx_cpymem(*dst, p, 6);
+        return p + 6;
+    }
+    p += 6;
+
+    // Characters outside the BMP are escaped as a pair of UTF-16 surrogates
+    if (cp >= 0xd800 && cp <= 0xdbff)
+    {
+        ngx_int_t low = end - p >= 6 && p[0] == '\\' && p[1] == 'u' ? hex4(p + 2, end) : -1;
+        if (low >= 0xdc00 && low <= 0xdfff)
+        {
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            p += 6;
+        }
+        else
+            cp = CLJ_REPLACEMENT_CHAR;
+    }
+    else if (cp >= 0xdc00 && cp <= 0xdfff)
+        cp = CLJ_REPLACEMENT_CHAR;
+
+    // At most 4 bytes for 12 escaped ones, decoding never outgrows the input
+    *dst = utf8(*dst, (uint32_t)cp);
+    return p;
+}
+
+static u_char *digits(u_char *p, u_char *end)
+{
+    while (p < end && *p >= '0' && *p <= '9')
+        ++p;
+
+    return p;
+}
+
+ngx_int_t ngx_http_cljson_string(ngx_pool_t *pool, u_char *start, size_t len,
+    ngx_str_t *value)
+{
+    // Most strings have no escape sequence at all: pointing into the document
+    u_char *esc = memchr(start, '\\', len);
+    if (esc == NULL)
+    {
+        value->data = start;
+        value->len = len;
+        return NGX_OK;
+    }
+
+    u_char *dst = ngx_pnalloc(pool, len);
+    if (dst == NULL)
+        return NGX_ERROR;
+    value->data = dst;
+
+    u_char *src = start, *end = start + len;
+    while (esc != NULL)
+    {
+        dst = ngx_cpymem(dst, src, esc - src);
+        src = unescape(esc, end, &dst);
+        esc = memchr(src, '\\', end - src);
+    }
+    dst = ngx_cpymem(dst, src, end - src);
+    value->len = dst - value->data;
+
+    return NGX_OK;
+}
+
+ngx_int_t ngx_http_cljson_primitive(ngx_pool_t *pool, u_char *start, size_t len,
+    ngx_str_t *value)
+{
+    value->data = start;
+    value->len = len;
+
+    if (len == 4 && ngx_strncmp(start, "true", 4) == 0)
+    {
+        ngx_str_set(value, "1");
+        return NGX_OK;
+    }
+    if (len == 5 && ngx_strncmp(start, "false", 5) == 0)
+    {
+        ngx_str_set(value, "0");
+        return NGX_OK;
+    }
+    if (len == 4 && ngx_strncmp(start, "null", 4) == 0)
+    {
+        ngx_str_null(value);
+        return NGX_OK;
+    }
+
+    // Number: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+    u_char *end = start + len;
+    u_char *p = start < end && *start == '-' ? start + 1 : start;
+    u_char *int_end = digits(p, end);
+    if (int_end == p || (*p == '0' && int_end - p > 1))
+        return NGX_OK;
+
+    u_char *frac = int_end, *frac_end = int_end;
+    if (frac < end && *frac == '.')
+    {
+        frac_end = digits(++frac, end);
+        if (frac_end == frac)
+            return NGX_OK;
+    }
+
+    u_char *exp = frac_end, *exp_end = frac_end;
+    ngx_flag_t exp_neg = 0;
+    if (exp < end && (*exp == 'e' || *exp == 'E'))
+    {
+        if (++exp < end && (*exp == '+' || *exp == '-'))
+            exp_neg = *exp++ == '-';
+        exp_end = digits(exp, end);
+        if (exp_end == exp)
+            return NGX_OK;
+    }
+    if (exp_end != end)
+        return NGX_OK;
+
+    // Trailing zeros of the fraction, and the point if nothing is left
+    while (frac_end > frac && frac_end[-1] == '0')
+        --frac_end;
+    u_char *mant_end = frac_end > frac ? frac_end : int_end;
+
+    if (int_end - p == 1 && *p == '0' && mant_end == int_end) // zero, whatever its sign and exponent
+    {
+        ngx_str_set(value, "0");
+        return NGX_OK;
+    }
+
+    while (exp < exp_end && *exp == '0')
+        ++exp;
+
+    // Without exponent, the normalized number is a prefix of the original one
+    if (exp == exp_end)
+    {
+        value->len = mant_end - start;
+        return NGX_OK;
+    }
+
+    u_char *dst = ngx_pnalloc(pool, len);
+    if (dst == NULL)
+        return NGX_ERROR;
+    value->data = dst;
+
+    dst = ngx_cpymem(dst, start, mant_end - start);
+    *dst++ = 'e';
+    if (exp_neg)
+        *dst++ = '-';
+    dst = ngx_cpymem(dst, exp, exp_end - exp);
+    value->len = dst - value->data;
+
+    return NGX_OK;
+}
+
+ngx_int_t ngx_http_cljson_value(ngx_pool_t *pool, u_char *doc, jsmntok_t *tok,
+    ngx_str_t *value)
+{
+    u_char *start = doc + tok->start;
+    size_t len = tok->end - tok->start;
+
+    switch (tok->type)
+    {
+    case JSMN_STRING:
+        return ngx_http_cljson_string(pool, start, len, value);
+    case JSMN_PRIMITIVE:
+        return ngx_http_cljson_primitive(pool, start, len, value);
+    default: // objects and arrays, as in the document
+        value->data = start;
+        value->len = len;
+        return NGX_OK;
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef NGX_HTTP_CLJSON_H
+# define NGX_HTTP_CLJSON_H
+
+# include <ngx_core.h>
+# include "lib/jsmn.h"
+
+/**
+ * @brief Replacement of lone UTF-16 surrogates in \u escapes (U+FFFD)
+ */
+# define CLJ_REPLACEMENT_CHAR (0xfffd)
+
+/**
+ * @brief Escaped code points below this one (control characters) are kept escaped
+ */
+# define CLJ_MIN_DECODED_CHAR (0x20)
+
+/**
+ * @brief Returns the value of a JSON token, as exposed in variables
+ * @details Strings are unescaped (but for control characters), numbers in
+ *  their shortest form, booleans `1` or `0` (truthy in `if`), `null` absent
+ *  (`data` is NULL). Objects and
+ *  arrays are kept as is. Values point into `doc` unless they had to be
+ *  rewritten, e.g. strings with escape sequences, then they are allocated in `pool`.
+ * @returns NGX_OK, NGX_ERROR on allocation failure
+ */
+ngx_int_t ngx_http_cljson_value(ngx_pool_t *pool, u_char *doc, jsmntok_t *tok,
+    ngx_str_t *value);
+
+/**
+ * @brief Unescapes a JSON string (without its quotes), see ngx_http_cljson_value
+ * @details Runs between escape sequences are found with memchr and copied in
+ *  bulk, nothing is allocated when there is none.
+ */
+ngx_int_t ngx_http_cljson_string(ngx_pool_t *pool, u_char *start, size_t len,
+    ngx_str_t *value);
+
+/**
+ * @brief Normalizes a JSON primitive, see ngx_http_cljson_value
+ * @details Primitives which are not valid JSON are kept as is.
+ */
+ngx_int_t ngx_http_cljson_primitive(ngx_pool_t *pool, u_char *start, size_t len,
+    ngx_str_t *value);
+
+#endif // !NGX_HTTP_CLJSON_H
@@ -0,0 +1,80 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_http_cllimit.h"
+
+ngx_http_cllimit_s *ngx_http_cllimit_create(ngx_pool_t *pool)
+{
+    ngx_http_cllimit_s *l = ngx_palloc(pool, sizeof (ngx_http_cllimit_s));
+    if (l == NULL)
+        return NULL;
+
+    l->nodes = NULL;
+
+    return l;
+}
+
+ngx_http_cllimit_node_s *ngx_http_cllimit_node(ngx_http_cllimit_s *l, ngx_log_t *log,
+    ngx_str_t *name, ngx_uint_t max)
+{
+    size_t len = name->len;
+
+    ngx_http_cllimit_node_s *node;
+    for (node = l->nodes; node != NULL; node = node->next)
+        if (ngx_memn2cmp(node->name.data, name->data, node->name.len, len) == 0)
+            return node;
+
+    // Never freed, there are as many nodes as in the cluster
+    if ((node = ngx_alloc(sizeof (ngx_http_cllimit_node_s) + len, log)) == NULL)
+        return NULL;
+
+    node->name.data = (u_char *)(node + 1);
+    node->name.len = len;
+    if (len > 0)
+        ngx_memcpy(node->name.data, name->data, len);
+    node->limit = max * CLL_SCALE;
+    node->inflight = 0;
+    ngx_queue_init(&node->waiting);
+    node->nwaiting = 0;
+    node->decreased = 0;
+    node->next = l->nodes;
+    l->nodes = node;
+
+    return node;
+}
+
+ngx_int_t ngx_http_cllimit_acquire(ngx_http_cllimit_node_s *node, ngx_uint_t max)
+{
+    if (node->inflight >= ngx_min(node->limit / CLL_SCALE, max))
+        return NGX_BUSY;
+
+    node->inflight++;
+
+    return NGX_OK;
+}
+
+void ngx_http_cllimit_release(ngx_http_cllimit_node_s *node, ngx_msec_t rtt,
+    ngx_flag_t failed, ngx_uint_t max, ngx_msec_t latency)
+{
+    node->inflight--;
+
+    if (!failed && rtt <= latency)
+    {
+        // Additive increase: about one lookup per round trip of the whole window,
+        // never lowering a limit grown by a location with a higher bound
+        if (node->limit < max * CLL_SCALE)
+            node->limit = ngx_min(node->limit + CLL_SCALE * CLL_SCALE / node->limit,
+                max * CLL_SCALE);
+        return;
+    }
+
+    // Multiplicative decrease, once for all the lookups of a congestion episode
+    if (ngx_current_msec - node->decreased < latency)
+        return;
+    node->limit = ngx_max(node->limit / 2, CLL_SCALE);
+    node->decreased = ngx_current_msec;
+}
+
+void ngx_http_cllimit_cancel(ngx_http_cllimit_node_s *node)
+{
+    node->inflight--;
+}
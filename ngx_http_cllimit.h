@@ -0,0 +1,74 @@
+#ifndef NGX_HTTP_CLLIMIT_H
+# define NGX_HTTP_CLLIMIT_H
+
+# include <ngx_core.h>
+
+/**
+ * @brief Limits are fixed-point, in 1/CLL_SCALE lookups
+ */
+# define CLL_SCALE (1024)
+
+/**
+ * @brief In-flight lookups of a couchbase node, in a worker
+ * @details The limit grows by one lookup per limit's worth of fast round
+ *  trips, and is halved on slow or failed ones (AIMD).
+ */
+typedef struct ngx_http_cllimit_node_s {
+    ngx_str_t name; // `host:port`, empty when the node of a key is unknown
+    ngx_uint_t limit; // in 1/CLL_SCALE lookups
+    ngx_uint_t inflight;
+    ngx_queue_t waiting; // lookups queued by the caller while the limit is reached
+    ngx_uint_t nwaiting;
+    ngx_msec_t decreased; // time of the last decrease, at most one per latency period
+    struct ngx_http_cllimit_node_s *next;
+} ngx_http_cllimit_node_s;
+
+/**
+ * @brief Per-worker limits of couchbase nodes, whatever the location
+ * @details Only ever accessed by the worker owning it: no locking at all.
+ *  Locations can have different bounds and latencies, they are passed along
+ *  with each lookup.
+ */
+typedef struct {
+    ngx_http_cllimit_node_s *nodes; // added as keys map to them
+} ngx_http_cllimit_s;
+
+/**
+ * @brief Allocates an empty table of node limits
+ * @returns Limits allocated in `pool`, NULL on allocation failure
+ */
+ngx_http_cllimit_s *ngx_http_cllimit_create(ngx_pool_t *pool);
+
+/**
+ * @brief Returns the limit of a node, added at `max` on first use
+ * @param name Node name, empty if unknown
+ * @param max Upper bound of the limit, in lookups
+ * @returns Node limit, NULL on allocation failure
+ */
+ngx_http_cllimit_node_s *ngx_http_cllimit_node(ngx_http_cllimit_s *l, ngx_log_t *log,
+    ngx_str_t *name, ngx_uint_t max);
+
+/**
+ * @brief Counts a lookup in flight if the node is under its limit
+ * @param max Upper bound of the limit for this lookup, in lookups
+ * @returns NGX_OK if counted, NGX_BUSY if the limit is reached
+ */
+ngx_int_t ngx_http_cllimit_acquire(ngx_http_cllimit_node_s *node, ngx_uint_t max);
+
+/**
+ * @brief Completes a lookup in flight, adapting the limit to its round trip
+ * @param rtt Round trip time of the lookup
+ * @param failed Whether the lookup timed out or failed on the couchbase side
+ * @param max Upper bound of the limit, in lookups
+ * @param latency Slower round trips decrease the limit
+ */
+void ngx_http_cllimit_release(ngx_http_cllimit_node_s *node, ngx_msec_t rtt,
+    ngx_flag_t failed, ngx_uint_t max, ngx_msec_t latency);
+
+/**
+ * @brief Completes a lookup in flight which did not reach the node
+ * @details The limit is left as is, e.g. for lookups served by the cache zone.
+ */
+void ngx_http_cllimit_cancel(ngx_http_cllimit_node_s *node);
+
+#endif // !NGX_HTTP_CLLIMIT_H
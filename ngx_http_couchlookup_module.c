@@ -1,59 +1,703 @@
 #include <ngx_core.h>
 #include <ngx_config.h>
 #include <ngx_http.h>
+#if (NGX_THREADS)
+# include <pthread.h>
+#endif
 #include "ngx_http_couchlookup_module.h"
+#include "ngx_http_couchlookup_probes.h"
 #include "ngx_http_libcouch_wrapper.h"
 #include "lib/jsmn.h"
 
 /**
- * @brief Variable handler
- * @param r Pointer to the request structure, see http_request.h
- * @param v Variable value, unused here
- * @param data Pointer to module config in this case
+ * @brief JSON token arena of the worker, reused across requests
  */
-static ngx_int_t ngx_http_couchlookup_variable_handler(ngx_http_request_t *r,
-    ngx_http_variable_value_t *v, uintptr_t data)
+static ngx_http_couchlookup_tokens_s ngx_http_couchlookup_worker_tokens;
+
+/**
+ * @brief Stores a value shared with the thread pool threads of the worker
+ * @param a Shared word
+ * @param value Value to store
+ */
+static void ngx_http_couchlookup_atomic_set(ngx_atomic_t *a, ngx_atomic_uint_t value)
 {
-    // Handler called every time the variable is referenced in the config
-    if (v->data != NULL) // No need to fetch its value if it's already set
-        return NGX_OK;
+    ngx_atomic_uint_t old;
+    do
+    {
+        old = *a;
+    }
+    while (old != value && !ngx_atomic_cmp_set(a, old, value));
+}
+
+/**
+ * @brief Bootstraps a couchbase instance of a cluster in a worker or thread
+ * @details The topology file is only read, the master process writes it. On
+ *  failure, the cluster is failed over for FAILOVER_RETRY_DEFAULT seconds.
+ * @param cluster Cluster to bootstrap
+ * @param log Log of the caller
+ * @returns Couchbase instance or NULL on failure
+ */
+static lcb_t ngx_http_couchlookup_bootstrap(ngx_http_couchlookup_instance_s *cluster,
+    ngx_log_t *log)
+{
+    lcw_creds_s creds = cluster->creds;
+    creds.config_cache_ro = 1;
+    lcb_t instance = lcw_init(&creds);
+    if (instance == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, log, 0, "Could not bootstrap cluster \"%s\", " \
+            "failed over for %d seconds", cluster->creds.host, FAILOVER_RETRY_DEFAULT);
+        ngx_http_couchlookup_atomic_set(&cluster->retry, ngx_time() + FAILOVER_RETRY_DEFAULT);
+    }
 
-    // Getting module configuration through the `data` argument, cannot use
-    // ngx_http_get_module_loc_conf in this instance (only for request handler).
-    ngx_http_couchlookup_conf_s *mcf = (ngx_http_couchlookup_conf_s *)data;
+    return instance;
+}
 
-    ngx_str_t couch_key;
-    if (ngx_http_complex_value(r, mcf->complex_couch_key, &couch_key) != NGX_OK)
-        return NGX_ERROR;
+#if (NGX_THREADS)
+/**
+ * @brief Per-thread state, see ngx_http_couchlookup_thread_get
+ */
+static pthread_key_t ngx_http_couchlookup_tls_key;
+static ngx_flag_t ngx_http_couchlookup_tls_key_created = 0;
 
-    lcw_get_result_s *couch_doc = lcw_get(r->pool, mcf->couch_instance, &couch_key);
-    if (couch_doc == NULL || couch_doc->status != LCB_SUCCESS)
+/**
+ * @brief Returns the state of the calling thread, allocated on first use
+ * @param log Log used for allocation errors
+ * @returns Thread state or NULL on allocation failure
+ */
+static ngx_http_couchlookup_thread_s *ngx_http_couchlookup_thread_get(ngx_log_t *log)
+{
+    ngx_http_couchlookup_thread_s *thr = pthread_getspecific(ngx_http_couchlookup_tls_key);
+    if (thr != NULL)
+        return thr;
+
+    if ((thr = ngx_calloc(sizeof (ngx_http_couchlookup_thread_s), log)) == NULL)
+        return NULL;
+    pthread_setspecific(ngx_http_couchlookup_tls_key, thr);
+
+    return thr;
+}
+
+/**
+ * @brief Returns the calling thread's couchbase instance for a cluster
+ * @details libcouchbase instances are not thread-safe, each thread of the
+ *  pool bootstraps its own on first use and keeps it for its lifetime.
+ *  Locations with the same creds share it, like in the event loop.
+ * @param thr State of the calling thread
+ * @param cluster Cluster to look up
+ * @param log Log used for allocation errors
+ * @returns Couchbase instance or NULL on failure
+ */
+static lcb_t ngx_http_couchlookup_thread_instance(ngx_http_couchlookup_thread_s *thr,
+    ngx_http_couchlookup_instance_s *cluster, ngx_log_t *log)
+{
+    ngx_http_couchlookup_tls_instance_s *it;
+    for (it = thr->instances; it != NULL; it = it->next)
+        if (it->owner == cluster)
+            return it->instance;
+
+    if ((it = ngx_alloc(sizeof (ngx_http_couchlookup_tls_instance_s), log)) == NULL)
+        return NULL;
+
+    if ((it->instance = ngx_http_couchlookup_bootstrap(cluster, log)) == NULL)
     {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
-            "Could not read couch document: %s", lcb_strerror(NULL, couch_doc->status));
-        goto failed;
+        ngx_free(it);
+        return NULL;
     }
 
-    // Parsing JSON in couch document
+    it->owner = cluster;
+    it->next = thr->instances;
+    thr->instances = it;
+
+    return it->instance;
+}
+#endif
+
+
+/**
+ * @brief Wraps a document copied out of the cache zone as a GET result
+ * @param pool Allocation pool of the cached copy
+ * @param cached Document copied out of the cache
+ * @returns GET result allocated in `pool`, NULL on allocation failure
+ */
+static lcw_get_result_s *ngx_http_couchlookup_cached_doc(ngx_pool_t *pool,
+    ngx_http_clcache_doc_s *cached)
+{
+    // Zeroed: no round trip, node nor replica for $couchlookup_* variables
+    lcw_get_result_s *res = ngx_pcalloc(pool, sizeof (lcw_get_result_s));
+    if (res == NULL)
+        return NULL;
+
+    res->data = cached->data;
+    res->len = cached->len;
+    res->cas = cached->cas;
+    res->status = LCB_SUCCESS;
+    res->pool = pool;
+
+    return res;
+}
+
+/**
+ * @brief Stores a freshly fetched document in the cache zone, if configured
+ * @details Called once the document is parsed, its hints (see
+ *  ngx_http_couchlookup_parse) set how long it is cached. Documents which
+ *  are not to be cached are removed, an older revision could be cached.
+ * @param mcf Module configuration
+ * @param fetch Fetch whose `couch_doc` is set, ignored unless fresh and successful
+ * @param valid Lifetime of the document in seconds, 0 not to cache it
+ */
+static void ngx_http_couchlookup_store(ngx_http_couchlookup_conf_s *mcf,
+    ngx_http_couchlookup_fetch_s *fetch, time_t valid)
+{
+    if (!fetch->fresh)
+        return;
+
+    lcw_get_result_s *couch_doc = fetch->couch_doc;
+    fetch->expire = ngx_time() + valid;
+    if (mcf->cache_zone == NULL || couch_doc == NULL || couch_doc->status != LCB_SUCCESS)
+        return;
+
+    if (valid > 0)
+        ngx_http_clcache_store(mcf->cache_zone, fetch->couch_key, couch_doc->data,
+            couch_doc->len, couch_doc->cas, valid, &fetch->generation);
+    else
+        ngx_http_clcache_remove(mcf->cache_zone, fetch->couch_key);
+}
+
+/**
+ * @brief Accounts a couchbase round trip in the statistics of a lookup
+ * @param stats Statistics of the lookup
+ * @param res Result of the round trip, NULL on allocation failure
+ */
+static void ngx_http_couchlookup_stats_add(ngx_http_couchlookup_stats_s *stats,
+    lcw_get_result_s *res)
+{
+    if (res == NULL)
+    {
+        stats->status = LCB_CLIENT_ENOMEM;
+        return;
+    }
+
+    stats->time_us += res->time_us;
+    stats->ops += 1 + res->hedged;
+    stats->status = res->status;
+    stats->node = res->node;
+    if (res->data != NULL && res->status == LCB_SUCCESS)
+        stats->doc_bytes = res->len;
+}
+
+/**
+ * @brief Reserves the budget of a hedged request, see lcw_hedge_s
+ */
+static ngx_flag_t ngx_http_couchlookup_hedge_reserve(void *data)
+{
+    return ngx_http_clhedge_reserve(data);
+}
+
+/**
+ * @brief Gives back the budget of a hedged request, see lcw_hedge_s
+ */
+static void ngx_http_couchlookup_hedge_release(void *data)
+{
+    ngx_http_clhedge_release(data);
+}
+
+/**
+ * @brief Flags the GET operations which can be hedged
+ * @details The budget is reserved as hedged requests are issued, only
+ *  lookups are accounted here.
+ * @param mcf Module configuration
+ * @param ops Operations about to be scheduled
+ * @param n Number of operations
+ * @param hedge Hedging of the batch, set if any operation is hedged
+ * @returns `hedge`, NULL if none is hedged
+ */
+static lcw_hedge_s *ngx_http_couchlookup_hedge(ngx_http_couchlookup_conf_s *mcf,
+    lcw_get_op_s *ops, ngx_uint_t n, lcw_hedge_s *hedge)
+{
+    if (mcf->hedge == NULL)
+        return NULL;
+
+    uint32_t hedge_us = ngx_http_clhedge_delay(mcf->hedge);
+    ngx_uint_t i, lookups = 0;
+    for (i = 0; i < n; ++i)
+    {
+        ops[i].hedge = hedge_us > 0 && !ops[i].meta_only;
+        lookups += !ops[i].meta_only;
+    }
+    ngx_http_clhedge_count(mcf->hedge, lookups);
+    if (hedge_us == 0)
+        return NULL;
+
+    hedge->delay_us = hedge_us;
+    hedge->reserve = ngx_http_couchlookup_hedge_reserve;
+    hedge->release = ngx_http_couchlookup_hedge_release;
+    hedge->data = mcf->hedge;
+    return hedge;
+}
+
+/**
+ * @brief Accounts completed GET operations in the hedging policy, if configured
+ * @param mcf Module configuration
+ * @param ops Completed operations
+ * @param n Number of operations
+ */
+static void ngx_http_couchlookup_hedge_observe(ngx_http_couchlookup_conf_s *mcf,
+    lcw_get_op_s *ops, ngx_uint_t n)
+{
+    if (mcf->hedge == NULL)
+        return;
+
+    ngx_uint_t i;
+    for (i = 0; i < n; ++i)
+        if (!ops[i].meta_only && ops[i].result != NULL)
+            ngx_http_clhedge_observe(mcf->hedge, ops[i].result->time_us);
+}
+
+/**
+ * @brief Fetches couch documents, going through the cache zone if configured
+ * @details Expired entries are revalidated with a metadata-only lookup, the
+ *  body is only fetched again when the document CAS has changed. All the
+ *  round trips of a step are scheduled together (see lcw_get_multi).
+ * @param instance Couchbase instance to use, NULL if it could not be bootstrapped
+ * @param mcf Module configuration
+ * @param fetches Documents to fetch, `couch_doc`, `generation`, `expire`,
+ *  `fresh` and `stats` are set on each of them: fresh documents are stored
+ *  by the caller once parsed
+ * @param n Number of documents to fetch
+ */
+static void ngx_http_couchlookup_fetch(lcb_t instance, ngx_http_couchlookup_conf_s *mcf,
+    ngx_http_couchlookup_fetch_s *fetches, ngx_uint_t n)
+{
+    lcw_get_op_s ops[n];
+    ngx_uint_t op_fetch[n]; // ops index -> fetches index
+    ngx_http_clcache_doc_s cached[n];
+    lcw_hedge_s hedge;
+    ngx_uint_t i, o, nops = 0;
+
+    for (i = 0; i < n; ++i)
+    {
+        fetches[i].couch_doc = NULL;
+        fetches[i].generation = 0;
+        fetches[i].expire = 0;
+        fetches[i].fresh = 0;
+        ngx_memzero(&fetches[i].stats, sizeof (ngx_http_couchlookup_stats_s));
+        fetches[i].stats.status = LCB_SUCCESS;
+        fetches[i].stats.cache_status = mcf->cache_zone == NULL ? CL_CACHE_BYPASS : CL_CACHE_MISS;
+
+        // Read before the lookup, a change made meanwhile makes copies outdated
+        if (mcf->cache_zone != NULL)
+            fetches[i].generation = ngx_http_clcache_generation(mcf->cache_zone,
+                fetches[i].couch_key);
+
+        ngx_http_clcache_status_e cst = mcf->cache_zone == NULL ? CLC_MISS
+            : ngx_http_clcache_lookup(mcf->cache_zone, fetches[i].pool,
+                fetches[i].couch_key, &cached[i]);
+
+        if (cst == CLC_HIT)
+        {
+            fetches[i].couch_doc = ngx_http_couchlookup_cached_doc(fetches[i].pool, &cached[i]);
+            fetches[i].expire = cached[i].expire;
+            fetches[i].stats.cache_status = CL_CACHE_HIT;
+            fetches[i].stats.doc_bytes = cached[i].len;
+            CL_PROBE4(cache__hit, fetches[i].couch_key->data, fetches[i].couch_key->len,
+                cached[i].len, CL_CACHE_HIT);
+            continue;
+        }
+        if (cst == CLC_STALE)
+            fetches[i].stats.cache_status = CL_CACHE_STALE;
+        CL_PROBE3(cache__miss, fetches[i].couch_key->data, fetches[i].couch_key->len,
+            fetches[i].stats.cache_status);
+
+        ops[nops].pool = fetches[i].pool;
+        ops[nops].couch_key = fetches[i].couch_key;
+        ops[nops].meta_only = cst == CLC_STALE;
+        ops[nops].result = NULL;
+        op_fetch[nops++] = i;
+    }
+
+    if (nops == 0)
+        return;
+
+    if (instance != NULL)
+    {
+        lcw_get_multi(instance, ops, nops, ngx_http_couchlookup_hedge(mcf, ops, nops, &hedge));
+        ngx_http_couchlookup_hedge_observe(mcf, ops, nops);
+    }
+
+    // Documents whose CAS changed (or without metadata) need a second round trip
+    lcw_get_op_s refetch_ops[nops];
+    ngx_uint_t refetch_fetch[nops];
+    ngx_uint_t nrefetch = 0;
+    for (o = 0; o < nops; ++o)
+    {
+        i = op_fetch[o];
+        lcw_get_result_s *res = ops[o].result;
+        ngx_http_couchlookup_stats_add(&fetches[i].stats, res);
+        if (!ops[o].meta_only)
+        {
+            fetches[i].couch_doc = res;
+            fetches[i].fresh = 1;
+            continue;
+        }
+
+        if (res != NULL && res->status == LCB_SUCCESS && res->cas == cached[i].cas)
+        {
+            ngx_http_clcache_revalidate(mcf->cache_zone, fetches[i].couch_key, cached[i].cas);
+            fetches[i].couch_doc = ngx_http_couchlookup_cached_doc(fetches[i].pool, &cached[i]);
+            fetches[i].expire = ngx_time() + cached[i].valid;
+            fetches[i].stats.doc_bytes = cached[i].len;
+        }
+        else
+        {
+            ngx_pfree(fetches[i].pool, cached[i].data);
+            refetch_ops[nrefetch].pool = fetches[i].pool;
+            refetch_ops[nrefetch].couch_key = fetches[i].couch_key;
+            refetch_ops[nrefetch].meta_only = 0;
+            refetch_ops[nrefetch].result = NULL;
+            refetch_fetch[nrefetch++] = i;
+        }
+
+        if (res != NULL)
+            lcw_get_result_destroy(res);
+    }
+
+    if (nrefetch == 0)
+        return;
+
+    if (instance != NULL)
+    {
+        lcw_get_multi(instance, refetch_ops, nrefetch,
+            ngx_http_couchlookup_hedge(mcf, refetch_ops, nrefetch, &hedge));
+        ngx_http_couchlookup_hedge_observe(mcf, refetch_ops, nrefetch);
+    }
+    for (o = 0; o < nrefetch; ++o)
+    {
+        i = refetch_fetch[o];
+        fetches[i].couch_doc = refetch_ops[o].result;
+        ngx_http_couchlookup_stats_add(&fetches[i].stats, fetches[i].couch_doc);
+        fetches[i].fresh = 1;
+    }
+}
+
+/**
+ * @brief Returns the cluster lookups should go to
+ * @details The first healthy cluster by priority, or due to be tried again
+ *  after a failover. If none is, the first one by priority.
+ * @param mcf Module configuration
+ * @param skip Cluster to skip, e.g. the one a lookup just failed on
+ * @returns Cluster, NULL if there is no other one than `skip`
+ */
+static ngx_http_couchlookup_instance_s *ngx_http_couchlookup_cluster_pick(
+    ngx_http_couchlookup_conf_s *mcf, ngx_http_couchlookup_instance_s *skip)
+{
+    ngx_http_couchlookup_cluster_s *clusters = mcf->clusters->elts;
+    ngx_http_couchlookup_instance_s *fallback = NULL;
+    ngx_uint_t i;
+    for (i = 0; i < mcf->clusters->nelts; ++i)
+    {
+        ngx_http_couchlookup_instance_s *cluster = clusters[i].instance;
+        if (cluster == skip)
+            continue;
+        if (cluster->retry <= (ngx_atomic_uint_t)ngx_time())
+            return cluster;
+        if (fallback == NULL)
+            fallback = cluster;
+    }
+
+    return fallback;
+}
+
+/**
+ * @brief Returns the couchbase instance of a cluster for the caller
+ * @details Clusters which could not be bootstrapped at configuration time
+ *  are bootstrapped in the event loop once their failover is over.
+ * @param thr State of the calling thread, NULL in the event loop
+ * @param cluster Cluster to look up
+ * @param log Log used for allocation errors
+ * @returns Couchbase instance or NULL on failure
+ */
+static lcb_t ngx_http_couchlookup_cluster_instance(ngx_http_couchlookup_thread_s *thr,
+    ngx_http_couchlookup_instance_s *cluster, ngx_log_t *log)
+{
+#if (NGX_THREADS)
+    if (thr != NULL)
+        return ngx_http_couchlookup_thread_instance(thr, cluster, log);
+#endif
+    if (cluster->instance == NULL && cluster->retry <= (ngx_atomic_uint_t)ngx_time())
+        cluster->instance = ngx_http_couchlookup_bootstrap(cluster, log);
+    return cluster->instance;
+}
+
+/**
+ * @brief Accounts a lookup in the health of a cluster
+ * @details Clusters are failed over after consecutive failures, or when their
+ *  smoothed round trip is over the failover latency. Called by the worker
+ *  and its thread pool threads concurrently: all updates are atomic.
+ * @param mcf Module configuration
+ * @param cluster Cluster the lookup went to
+ * @param stats Statistics of the lookup, ignored without round trip
+ */
+static void ngx_http_couchlookup_cluster_health(ngx_http_couchlookup_conf_s *mcf,
+    ngx_http_couchlookup_instance_s *cluster, ngx_http_couchlookup_stats_s *stats)
+{
+    if (stats->time_us == 0 && stats->status == LCB_SUCCESS) // served by the cache zone
+        return;
+
+    if (stats->status != LCB_SUCCESS && stats->status != LCB_KEY_ENOENT)
+    {
+        if (ngx_atomic_fetch_add(&cluster->failures, 1) + 1 >= mcf->failover_failures)
+            ngx_http_couchlookup_atomic_set(&cluster->retry, ngx_time() + mcf->failover_retry);
+        return;
+    }
+
+    // Tried again after a failover, round trips from before are outdated
+    ngx_atomic_uint_t old, rtt;
+    do
+    {
+        old = cluster->rtt_us;
+        rtt = cluster->retry != 0 ? stats->time_us
+            : (old * (FAILOVER_RTT_WEIGHT - 1) + stats->time_us) / FAILOVER_RTT_WEIGHT;
+    }
+    while (!ngx_atomic_cmp_set(&cluster->rtt_us, old, rtt));
+
+    ngx_http_couchlookup_atomic_set(&cluster->failures, 0);
+    ngx_http_couchlookup_atomic_set(&cluster->retry,
+        mcf->failover_latency > 0 && rtt > mcf->failover_latency * 1000
+        ? ngx_time() + mcf->failover_retry : 0);
+}
+
+/**
+ * @brief Fetches couch documents from the preferred cluster, failing over
+ * @details Lookups which failed on the preferred cluster (other than missing
+ *  documents) are tried once on the next cluster.
+ * @param thr State of the calling thread, NULL in the event loop
+ * @param log Log of the caller
+ * @param mcf Module configuration
+ * @param fetches Documents to fetch, see ngx_http_couchlookup_fetch
+ * @param n Number of documents to fetch
+ */
+static void ngx_http_couchlookup_fetch_clusters(ngx_http_couchlookup_thread_s *thr,
+    ngx_log_t *log, ngx_http_couchlookup_conf_s *mcf, ngx_http_couchlookup_fetch_s *fetches,
+    ngx_uint_t n)
+{
+    ngx_http_couchlookup_instance_s *cluster = ngx_http_couchlookup_cluster_pick(mcf, NULL);
+    ngx_http_couchlookup_fetch(ngx_http_couchlookup_cluster_instance(thr, cluster, log),
+        mcf, fetches, n);
+
+    ngx_uint_t failed[n];
+    ngx_uint_t i, nfailed = 0;
+    for (i = 0; i < n; ++i)
+    {
+        if (fetches[i].stats.time_us > 0)
+            fetches[i].stats.cluster = cluster;
+        ngx_http_couchlookup_cluster_health(mcf, cluster, &fetches[i].stats);
+        if (fetches[i].stats.status != LCB_SUCCESS && fetches[i].stats.status != LCB_KEY_ENOENT)
+            failed[nfailed++] = i;
+    }
+
+    ngx_http_couchlookup_instance_s *next = ngx_http_couchlookup_cluster_pick(mcf, cluster);
+    if (nfailed == 0 || next == NULL)
+        return;
+
+    ngx_http_couchlookup_fetch_s refetches[nfailed];
+    for (i = 0; i < nfailed; ++i)
+    {
+        refetches[i].pool = fetches[failed[i]].pool;
+        refetches[i].couch_key = fetches[failed[i]].couch_key;
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+            "Couch lookup of \"%V\" failed on cluster \"%s\", failing over to \"%s\"",
+            refetches[i].couch_key, cluster->creds.host, next->creds.host);
+    }
+
+    ngx_http_couchlookup_fetch(ngx_http_couchlookup_cluster_instance(thr, next, log),
+        mcf, refetches, nfailed);
+
+    for (i = 0; i < nfailed; ++i)
+    {
+        if (refetches[i].stats.time_us > 0)
+            refetches[i].stats.cluster = next;
+        ngx_http_couchlookup_cluster_health(mcf, next, &refetches[i].stats);
+        refetches[i].stats.time_us += fetches[failed[i]].stats.time_us;
+        refetches[i].stats.ops += fetches[failed[i]].stats.ops;
+        fetches[failed[i]] = refetches[i];
+    }
+}
+
+/**
+ * @brief Tokenizes a JSON document, growing the token arena as needed
+ * @details Documents are parsed directly if the arena is large enough. If not,
+ *  tokens are counted (jsmn without token array) to size the arena exactly.
+ * @param tokbuf Token arena of the worker or thread
+ * @param log Log used for allocation errors
+ * @param couch_doc Successful GET result
+ * @returns Number of tokens, or jsmn error code
+ */
+static int ngx_http_couchlookup_tokenize(ngx_http_couchlookup_tokens_s *tokbuf,
+    ngx_log_t *log, lcw_get_result_s *couch_doc)
+{
     jsmn_parser jparser;
-    jsmntok_t tokens[JSON_MAX_TOKENS];
+    int tok_res = JSMN_ERROR_NOMEM;
+    if (tokbuf->size > 0)
+    {
+        jsmn_init(&jparser);
+        tok_res = jsmn_parse(&jparser, (char *)couch_doc->data, couch_doc->len,
+            tokbuf->tokens, tokbuf->size);
+    }
+    if (tok_res != JSMN_ERROR_NOMEM)
+        return tok_res;
+
+    jsmn_init(&jparser);
+    int count = jsmn_parse(&jparser, (char *)couch_doc->data, couch_doc->len, NULL, 0);
+    if (count < 0)
+        return count;
+
+    if ((unsigned)count > tokbuf->size)
+    {
+        unsigned size = ngx_max((unsigned)count, JSON_MIN_TOKENS);
+        jsmntok_t *tokens = ngx_alloc(sizeof (jsmntok_t) * size, log);
+        if (tokens == NULL)
+            return JSMN_ERROR_NOMEM;
+
+        if (tokbuf->tokens != NULL)
+            ngx_free(tokbuf->tokens);
+        tokbuf->tokens = tokens;
+        tokbuf->size = size;
+    }
+
     jsmn_init(&jparser);
-    int tok_res = jsmn_parse(&jparser, (char *)couch_doc->data, couch_doc->len, tokens, JSON_MAX_TOKENS);
+    return jsmn_parse(&jparser, (char *)couch_doc->data, couch_doc->len,
+        tokbuf->tokens, tokbuf->size);
+}
+
+/**
+ * @brief Maps the values of couchlookup_enum fields to their ids
+ * @details Runs once per parsed document, ids are then cached along with
+ *  the other values.
+ * @param mcf Module configuration
+ * @param values Values indexed by variable slot
+ */
+static void ngx_http_couchlookup_map(ngx_http_couchlookup_conf_s *mcf, ngx_str_t *values)
+{
+    if (mcf->enums == NULL)
+        return;
+
+    ngx_http_couchlookup_enum_s *enums = mcf->enums->elts;
+    ngx_uint_t i, id;
+    for (i = 0; i < mcf->enums->nelts; ++i)
+    {
+        ngx_str_t *value = &values[enums[i].slot];
+        for (id = 0; id < enums[i].nvalues; ++id)
+            if (value->data != NULL && value->len == enums[i].values[id].len
+                && ngx_memcmp(value->data, enums[i].values[id].data, value->len) == 0)
+                break;
+
+        // Falls through to ids[0] when no expected value matched
+        values[enums[i].id_slot] = enums[i].ids[id == enums[i].nvalues ? 0 : id + 1];
+    }
+}
+
+/**
+ * @brief Applies a cache hint of a couch document to its lifetime
+ * @details CACHE_HINT_TTL is a number of seconds or a time (e.g. "1h"), 0 is
+ *  the same as CACHE_HINT_NOCACHE set to true, and longer lifetimes than
+ *  CACHE_HINT_TTL_MAX are cut down to it. Invalid hints are ignored.
+ * @param log Log used for invalid hints
+ * @param couch_key Couchbase key of the document
+ * @param couch_doc Document being parsed
+ * @param tok Token of the hint value
+ * @param hint Name of the hint field
+ * @param valid Lifetime of the document, updated
+ */
+static void ngx_http_couchlookup_hint(ngx_log_t *log, ngx_str_t *couch_key,
+    lcw_get_result_s *couch_doc, jsmntok_t *tok, const char *hint, time_t *valid)
+{
+    ngx_str_t value;
+    if (tok->type != JSMN_STRING && tok->type != JSMN_PRIMITIVE)
+        goto invalid;
+    if (ngx_http_cljson_value(couch_doc->pool, couch_doc->data, tok, &value) != NGX_OK
+        || value.data == NULL) // null, same as absent
+        return;
+
+    if (ngx_strcmp(hint, CACHE_HINT_NOCACHE) == 0)
+    {
+        if (value.len == 1 && value.data[0] == '1')
+            *valid = 0;
+        return;
+    }
+
+    if (*valid == 0) // not cached anyway
+        return;
+
+    // Primitives other than null are numbers or booleans, the latter decoded as "1" and "0"
+    if (tok->type == JSMN_PRIMITIVE
+        && (couch_doc->data[tok->start] < '0' || couch_doc->data[tok->start] > '9'))
+        goto invalid;
+    time_t ttl = tok->type == JSMN_PRIMITIVE ? ngx_atotm(value.data, value.len)
+        : ngx_parse_time(&value, 1);
+    if (ttl == (time_t)NGX_ERROR)
+        goto invalid;
+    *valid = ngx_min(ttl, CACHE_HINT_TTL_MAX);
+    return;
+
+invalid:
+    ngx_log_error(NGX_LOG_WARN, log, 0, "Invalid %s hint in couch document \"%V\", ignored",
+        hint, couch_key);
+}
+
+/**
+ * @brief Extracts the declared variables from a couch document
+ * @details Safe to run in a thread pool: only touches `log`, the document (and
+ *  its pool) and the token arena of the calling thread. Values are decoded
+ *  (see ngx_http_cljson_value) and point into the document, or its pool when
+ *  rewritten: both are kept by the caller.
+ * @param tokbuf Token arena of the worker or thread
+ * @param log Log used for errors
+ * @param mcf Module configuration
+ * @param couch_key Couchbase key of the document
+ * @param couch_doc GET result, can be NULL or unsuccessful
+ * @param values Array of mcf->nvars values (indexed by variable slot), zeroed
+ * @param valid Set to the cache lifetime of the document, from its
+ *  CACHE_HINT_TTL and CACHE_HINT_NOCACHE fields if any, can be NULL
+ * @returns NGX_OK on success, NGX_ERROR if the document could not be used
+ */
+static ngx_int_t ngx_http_couchlookup_parse(ngx_http_couchlookup_tokens_s *tokbuf,
+    ngx_log_t *log, ngx_http_couchlookup_conf_s *mcf, ngx_str_t *couch_key,
+    lcw_get_result_s *couch_doc, ngx_str_t *values, time_t *valid)
+{
+    if (valid != NULL)
+        *valid = mcf->cache_valid;
+
+    if (couch_doc == NULL || couch_doc->status != LCB_SUCCESS)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+            "Could not read couch document \"%V\": %s", couch_key, couch_doc == NULL
+            ? "allocation failure" : lcb_strerror(NULL, couch_doc->status));
+        return NGX_ERROR;
+    }
+
+    CL_PROBE3(parse__start, couch_key->data, couch_key->len, couch_doc->len);
+
+    // Parsing JSON in couch document
+    int tok_res = ngx_http_couchlookup_tokenize(tokbuf, log, couch_doc);
+    jsmntok_t *tokens = tokbuf->tokens;
     if (tok_res < 0)
     {
         const char *err_str;
         JSON_ERROR(err_str, tok_res);
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
-            "Could not parse JSON from couch document: %s", err_str);
-        goto failed;
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+            "Could not parse JSON from couch document \"%V\": %s", couch_key, err_str);
+        CL_PROBE4(parse__end, couch_key->data, couch_key->len, couch_doc->len, NGX_ERROR);
+        return NGX_ERROR;
     }
 
     // Make sure the top-level element is an object
     if (tok_res < 1 || tokens[0].type != JSMN_OBJECT)
     {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
-            "Top-level JSON element in couch document needs to be an object");
-        goto failed;
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+            "Top-level JSON element in couch document \"%V\" needs to be an object", couch_key);
+        CL_PROBE4(parse__end, couch_key->data, couch_key->len, couch_doc->len, NGX_ERROR);
+        return NGX_ERROR;
     }
 
     int ti; // token index
@@ -71,9 +715,9 @@ static ngx_int_t ngx_http_couchlookup_variable_handler(ngx_http_request_t *r,
 
         char buf_key[JSON_BUF_KEY_SIZE];
         size_t key_len = tok_key.end - tok_key.start;
-        if (key_len > sizeof (buf_key))
+        if (key_len >= sizeof (buf_key))
         {
-            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
                 "Variable not set because JSON top-level key length is exceeding " \
                 "size limit of %d characters: %*s",
                 JSON_BUF_KEY_SIZE, key_len, couch_doc->data + tok_key.start);
@@ -87,25 +731,45 @@ static ngx_int_t ngx_http_couchlookup_variable_handler(ngx_http_request_t *r,
         if (sprintf((char *)buf_varname, VAR_NAME_TPL, buf_key) < 0)
             continue;
 
+        // Cache hints, also available as variables if declared
+        if (valid != NULL && (ngx_strcmp(buf_key, CACHE_HINT_TTL) == 0
+            || ngx_strcmp(buf_key, CACHE_HINT_NOCACHE) == 0))
+            ngx_http_couchlookup_hint(log, couch_key, couch_doc, &tok_val, buf_key, valid);
+
         ngx_str_t var_name = { .data = (u_char *)buf_varname, .len = var_len };
         ngx_http_aqvar_s *res = ngx_http_hashtb_get(mcf->aqvars, &var_name);
-        if (res != NULL)
-        {
-            ngx_http_variable_value_t *var = &r->variables[res->index];
+        if (res == NULL) // no failure case, var can be absent from JSON
+            continue;
 
-            var->len = tok_val.end - tok_val.start;
-            var->data = ngx_palloc(r->pool, sizeof (u_char) * (var->len + 1));
-            ngx_memcpy(var->data, couch_doc->data + tok_val.start, var->len);
-            var->data[var->len] = '\0';
-        } // no failure case, var can be absent from JSON
+        if (ngx_http_cljson_value(couch_doc->pool, couch_doc->data, &tok_val,
+                &values[res->slot]) != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                "Could not decode JSON value of \"%s\" in couch document \"%V\"", buf_key, couch_key);
+            CL_PROBE4(parse__end, couch_key->data, couch_key->len, couch_doc->len, NGX_ERROR);
+            return NGX_ERROR;
+        }
     }
 
-    unsigned vi; // `variable index`, needed in for loop after failed label
-failed:
-    if (couch_doc != NULL)
-        lcw_get_result_destroy(couch_doc);
+    ngx_http_couchlookup_map(mcf, values);
+
+    CL_PROBE4(parse__end, couch_key->data, couch_key->len, couch_doc->len, NGX_OK);
+
+    return NGX_OK;
+}
 
-    // Assigning an empty value to all the remaining untouched variables
+/**
+ * @brief Assigns extracted values to the request variables
+ * @details All the variables of the location are set at once, they are
+ *  evaluated again when flushed (e.g. after an internal redirect).
+ * @param r Pointer to the request structure
+ * @param mcf Module configuration
+ * @param values Values indexed by variable slot, NULL if the lookup failed
+ */
+static void ngx_http_couchlookup_fill(ngx_http_request_t *r,
+    ngx_http_couchlookup_conf_s *mcf, ngx_str_t *values)
+{
+    unsigned vi; // variable index
     for (vi = 0; vi < mcf->aqvars->size; ++vi)
     {
         if (mcf->aqvars->elts[vi] == NULL)
@@ -113,191 +777,2018 @@ failed:
 
         ngx_http_aqvar_s *var = mcf->aqvars->elts[vi]->data;
         ngx_http_variable_value_t *var_value = &r->variables[var->index];
-        if (var_value->data == NULL)
+        var_value->valid = 1;
+        var_value->no_cacheable = 1;
+        var_value->not_found = 0;
+        if (values != NULL && values[var->slot].data != NULL)
+        {
+            var_value->len = values[var->slot].len;
+            var_value->data = values[var->slot].data;
+        }
+        else
         {
+            // Assigning an empty value to variables absent from the document.
             // This macro needs to be surrounded by curly brackets to ensure
             // expected behaviour (contains multiple lines).
             ngx_str_set(var_value, "");
         }
     }
+}
 
-    return NGX_OK;
+/**
+ * @brief Marks the pool cleanup holding the lookup memo of a request tree
+ * @details The memo is found by its cleanup handler, as module contexts are
+ *  cleared on internal redirects. Documents live in the main request pool.
+ * @param data Head of the memo list, unused
+ */
+static void ngx_http_couchlookup_memo_cleanup(void *data)
+{
 }
 
 /**
- * @brief Configuration setup for credentials file
- * @param cf Module configuration structure pointer
- * @param cmd Module directives structure pointer
- * @param conf Module configuration structure pointer
- * @returns string Status of the configuration setup
+ * @brief Returns the lookup memo of a request tree (main request)
+ * @param r Pointer to the request structure
+ * @param create Whether to create the memo if absent
+ * @returns Pointer to the head of the memo list, NULL if absent
  */
-static char *ngx_http_couchlookup_creds(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static ngx_http_couchlookup_memo_s **ngx_http_couchlookup_memo_list(ngx_http_request_t *r,
+    ngx_flag_t create)
 {
-    // Module config
-    ngx_http_couchlookup_conf_s *mcf = conf;
+    ngx_pool_cleanup_t *cln;
+    for (cln = r->main->pool->cleanup; cln != NULL; cln = cln->next)
+        if (cln->handler == ngx_http_couchlookup_memo_cleanup)
+            return cln->data;
 
-    ngx_str_t *value = cf->args->elts;
-    ngx_str_t *creds_file = &value[1]; // value[0] is the command name
+    if (!create)
+        return NULL;
 
-    char *rc = NGX_CONF_ERROR;
-    char *buf = NULL;
+    cln = ngx_pool_cleanup_add(r->main->pool, sizeof (ngx_http_couchlookup_memo_s *));
+    if (cln == NULL)
+        return NULL;
+    cln->handler = ngx_http_couchlookup_memo_cleanup;
+    *(ngx_http_couchlookup_memo_s **)cln->data = NULL;
+
+    return cln->data;
+}
+
+/**
+ * @brief Finds a document already looked up in the request tree
+ * @details Lookups served by the L1 table have no document, they are only
+ *  reused by locations declaring the same variables, and not responding with
+ *  the document: couchlookup_pass locations look it up again, in the thread
+ *  pool if configured.
+ * @param r Pointer to the request structure
+ * @param mcf Module configuration
+ * @param couch_key Evaluated couchbase key
+ * @returns Memoized lookup or NULL if not found
+ */
+static ngx_http_couchlookup_memo_s *ngx_http_couchlookup_memo_find(ngx_http_request_t *r,
+    ngx_http_couchlookup_conf_s *mcf, ngx_str_t *couch_key)
+{
+    ngx_http_couchlookup_memo_s **list = ngx_http_couchlookup_memo_list(r, 0);
+    if (list == NULL)
+        return NULL;
+
+    ngx_http_couchlookup_cluster_s *clusters = mcf->clusters->elts;
+    ngx_http_couchlookup_memo_s *memo;
+    ngx_uint_t i;
+    for (memo = *list; memo != NULL; memo = memo->next)
+    {
+        if (ngx_memn2cmp(memo->couch_key.data, couch_key->data,
+                memo->couch_key.len, couch_key->len) != 0
+            || (memo->couch_doc == NULL && (mcf->pass || memo->mcf->aqvars != mcf->aqvars)))
+            continue;
+
+        // Same key, read from one of the clusters of the location
+        for (i = 0; i < mcf->clusters->nelts; ++i)
+            if (clusters[i].instance == memo->cluster)
+                return memo;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Memoizes a lookup for the rest of the request tree
+ * @param r Pointer to the request structure
+ * @param mcf Module configuration the values were extracted for
+ * @param couch_key Evaluated couchbase key
+ * @param couch_doc GET result, kept even if unsuccessful
+ * @param values Values indexed by variable slot, NULL if the lookup failed
+ * @param stats Statistics of the lookup
+ * @returns Memoized lookup, NULL on allocation failure
+ */
+static ngx_http_couchlookup_memo_s *ngx_http_couchlookup_memo_add(ngx_http_request_t *r,
+    ngx_http_couchlookup_conf_s *mcf, ngx_str_t *couch_key,
+    lcw_get_result_s *couch_doc, ngx_str_t *values, ngx_http_couchlookup_stats_s *stats)
+{
+    ngx_http_couchlookup_memo_s **list = ngx_http_couchlookup_memo_list(r, 1);
+    if (list == NULL)
+        return NULL;
+
+    ngx_http_couchlookup_memo_s *memo = ngx_palloc(r->main->pool, sizeof (ngx_http_couchlookup_memo_s));
+    if (memo == NULL)
+        return NULL;
+
+    memo->couch_key = *couch_key;
+    memo->cluster = stats->cluster != NULL ? stats->cluster
+        : ngx_http_couchlookup_cluster_pick(mcf, NULL);
+    memo->couch_doc = couch_doc;
+    memo->mcf = mcf;
+    memo->values = values;
+    memo->stats = *stats;
+    memo->next = *list;
+    *list = memo;
+
+    return memo;
+}
+
+/**
+ * @brief Returns the values of a memoized lookup for a location
+ * @details Other locations can declare other variables: the memoized
+ *  document is parsed again for them, without any round trip.
+ * @param r Pointer to the request structure
+ * @param memo Memoized lookup
+ * @param mcf Module configuration
+ * @returns Values indexed by variable slot, NULL if the lookup failed
+ */
+static ngx_str_t *ngx_http_couchlookup_memo_values(ngx_http_request_t *r,
+    ngx_http_couchlookup_memo_s *memo, ngx_http_couchlookup_conf_s *mcf)
+{
+    // Same variables, e.g. `if` blocks inheriting them
+    if (memo->mcf->aqvars == mcf->aqvars)
+        return memo->values;
+
+    ngx_str_t *values = ngx_pcalloc(r->pool, sizeof (ngx_str_t) * mcf->nvars);
+    if (values != NULL
+        && ngx_http_couchlookup_parse(&ngx_http_couchlookup_worker_tokens,
+            r->connection->log, mcf, &memo->couch_key, memo->couch_doc, values, NULL) != NGX_OK)
+        values = NULL;
+
+    memo->mcf = mcf;
+    memo->values = values;
+
+    return values;
+}
+
+/**
+ * @brief Looks up the values of a key in the worker's L1 table, if configured
+ * @param r Pointer to the request structure
+ * @param mcf Module configuration
+ * @param couch_key Evaluated couchbase key
+ * @returns Values allocated in the request pool, NULL if not found
+ */
+static ngx_str_t *ngx_http_couchlookup_l1_get(ngx_http_request_t *r,
+    ngx_http_couchlookup_conf_s *mcf, ngx_str_t *couch_key)
+{
+    if (mcf->l1 == NULL)
+        return NULL;
+
+    // Lock-free read of the shared generation, the table itself is worker-local
+    ngx_uint_t hits;
+    ngx_str_t *values = ngx_http_clcache_l1_get(mcf->l1, r->pool, couch_key, mcf->nvars,
+        ngx_http_clcache_generation(mcf->cache_zone, couch_key), &hits);
+    if (values != NULL)
+        CL_PROBE4(cache__hit, couch_key->data, couch_key->len, 0, CL_CACHE_L1);
+
+    // Hot keys served here stay hot and recently used in the zone, for admission and eviction
+    if (hits > 0)
+        ngx_http_clcache_touch(mcf->cache_zone, couch_key, hits);
+
+    return values;
+}
+
+/**
+ * @brief Copies extracted values in the worker's L1 table, if configured
+ * @param mcf Module configuration
+ * @param log Log used for allocation errors
+ * @param couch_key Evaluated couchbase key
+ * @param values Values indexed by variable slot, ignored if NULL
+ * @param generation Generation of the key when the document was read
+ * @param expire Time the document needs revalidation
+ */
+static void ngx_http_couchlookup_l1_put(ngx_http_couchlookup_conf_s *mcf, ngx_log_t *log,
+    ngx_str_t *couch_key, ngx_str_t *values, ngx_atomic_uint_t generation, time_t expire)
+{
+    // Not cached documents (CACHE_HINT_NOCACHE) expire right away
+    if (mcf->l1 != NULL && values != NULL && expire > ngx_time())
+        ngx_http_clcache_l1_put(mcf->l1, log, couch_key, values, mcf->nvars,
+            generation, expire);
+}
+
+/**
+ * @brief Looks up the document of a location, once per request tree
+ * @details Documents are only looked up once per request tree: subrequests,
+ *  internal redirects and other locations reuse the memoized lookup.
+ * @param r Pointer to the request structure
+ * @param mcf Module configuration
+ * @param couch_key Evaluated couchbase key
+ * @returns Memoized lookup, with the values of `mcf`, NULL on allocation failure
+ */
+static ngx_http_couchlookup_memo_s *ngx_http_couchlookup_lookup(ngx_http_request_t *r,
+    ngx_http_couchlookup_conf_s *mcf, ngx_str_t *couch_key)
+{
+    // Already looked up, possibly in the thread pool by ngx_http_couchlookup_handler
+    ngx_http_couchlookup_memo_s *memo = ngx_http_couchlookup_memo_find(r, mcf, couch_key);
+    if (memo != NULL)
+    {
+        ngx_http_couchlookup_memo_values(r, memo, mcf);
+        return memo;
+    }
+
+    CL_PROBE2(lookup__start, couch_key->data, couch_key->len);
+
+    ngx_str_t *values = ngx_http_couchlookup_l1_get(r, mcf, couch_key);
+    if (values != NULL)
+    {
+        ngx_http_couchlookup_stats_s stats = { .cache_status = CL_CACHE_L1, .status = LCB_SUCCESS };
+        return ngx_http_couchlookup_memo_add(r, mcf, couch_key, NULL, values, &stats);
+    }
+
+    values = ngx_pcalloc(r->pool, sizeof (ngx_str_t) * mcf->nvars);
+    if (values == NULL)
+        return NULL;
+
+    ngx_http_couchlookup_fetch_s fetch = { .pool = r->pool, .couch_key = couch_key };
+    ngx_http_couchlookup_fetch_clusters(NULL, r->connection->log, mcf, &fetch, 1);
+    uint64_t parse_start = lcw_clock_us();
+    time_t valid = mcf->cache_valid;
+    if (ngx_http_couchlookup_parse(&ngx_http_couchlookup_worker_tokens,
+            r->connection->log, mcf, couch_key, fetch.couch_doc, values, &valid) != NGX_OK)
+        values = NULL;
+    fetch.stats.parse_us = lcw_clock_us() - parse_start;
+    ngx_http_couchlookup_store(mcf, &fetch, valid);
+
+    ngx_http_couchlookup_l1_put(mcf, r->connection->log, couch_key, values,
+        fetch.generation, fetch.expire);
+
+    return ngx_http_couchlookup_memo_add(r, mcf, couch_key, fetch.couch_doc, values, &fetch.stats);
+}
+
+/**
+ * @brief Variable handler, shared by all the variables of all locations
+ * @details Handler called every time the variable is referenced in the config.
+ *  Variables are resolved against the document of the current location, a
+ *  variable declared by other locations only is not found.
+ * @param r Pointer to the request structure, see http_request.h
+ * @param v Variable value, set along with the other variables of the location
+ * @param data Unused, the same variable can be declared by several locations
+ */
+static ngx_int_t ngx_http_couchlookup_variable_handler(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_couchlookup_conf_s *mcf = ngx_http_get_module_loc_conf(r, ngx_http_couchlookup_module);
+    if (mcf->complex_couch_key == NULL)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    ngx_str_t couch_key;
+    if (ngx_http_complex_value(r, mcf->complex_couch_key, &couch_key) != NGX_OK)
+        return NGX_ERROR;
+
+    ngx_http_couchlookup_memo_s *memo = ngx_http_couchlookup_lookup(r, mcf, &couch_key);
+    if (memo == NULL)
+        return NGX_ERROR;
+
+    ngx_http_couchlookup_fill(r, mcf, memo->values);
+
+    // Declared by other locations only
+    if (!v->valid)
+        v->not_found = 1;
+
+    CL_PROBE3(fill__done, couch_key.data, couch_key.len, !v->not_found);
+
+    return NGX_OK;
+}
+
+/**
+ * @brief Content handler of couchlookup_pass, responds with the document
+ * @details The body points at the looked up document (or field value), kept in
+ *  the request pools. The ETag is the document CAS, conditional requests are
+ *  answered with 304 by the not modified filter.
+ * @param r Pointer to the request structure
+ * @returns Status of the response
+ */
+static ngx_int_t ngx_http_couchlookup_pass_handler(ngx_http_request_t *r)
+{
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)))
+        return NGX_HTTP_NOT_ALLOWED;
+
+    ngx_int_t rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK)
+        return rc;
+
+    ngx_http_couchlookup_conf_s *mcf = ngx_http_get_module_loc_conf(r, ngx_http_couchlookup_module);
+
+    ngx_str_t couch_key;
+    if (ngx_http_complex_value(r, mcf->complex_couch_key, &couch_key) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    ngx_http_couchlookup_memo_s *memo = ngx_http_couchlookup_lookup(r, mcf, &couch_key);
+    if (memo == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    // Never served by an L1 table, see ngx_http_couchlookup_memo_find
+    lcw_get_result_s *couch_doc = memo->couch_doc;
+    if (couch_doc == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (couch_doc->status == LCB_KEY_ENOENT)
+        return NGX_HTTP_NOT_FOUND;
+    if (couch_doc->status == LCB_EBUSY) // rejected by couchlookup_limit
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    if (couch_doc->status != LCB_SUCCESS)
+        return NGX_HTTP_BAD_GATEWAY;
+
+    ngx_str_t body = { .data = couch_doc->data, .len = couch_doc->len };
+    if (mcf->pass_slot != NGX_CONF_UNSET)
+    {
+        if (memo->values == NULL) // not a JSON object, logged by the parser
+            return NGX_HTTP_BAD_GATEWAY;
+        if (memo->values[mcf->pass_slot].data == NULL)
+            return NGX_HTTP_NOT_FOUND;
+        body = memo->values[mcf->pass_slot];
+    }
+
+    ngx_table_elt_t *etag = ngx_list_push(&r->headers_out.headers);
+    if (etag == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if ((etag->value.data = ngx_pnalloc(r->pool, NGX_INT64_LEN + sizeof ("\"\""))) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    etag->hash = 1;
+    ngx_str_set(&etag->key, "ETag");
+    etag->value.len = ngx_sprintf(etag->value.data, "\"%xL\"", couch_doc->cas) - etag->value.data;
+    r->headers_out.etag = etag;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = body.len;
+    r->headers_out.content_type = mcf->pass_type;
+    r->headers_out.content_type_len = mcf->pass_type.len;
+    r->allow_ranges = 1;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+        return rc;
+
+    ngx_buf_t *b = ngx_calloc_buf(r->pool);
+    if (b == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    // No copy, the document outlives the response
+    b->pos = body.data;
+    b->last = body.data + body.len;
+    b->memory = body.len > 0;
+    b->last_buf = r == r->main;
+    b->last_in_chain = 1;
+
+    ngx_chain_t out = { .buf = b, .next = NULL };
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/**
+ * @brief Variable handler of $couchlookup_* variables
+ * @details Statistics are the ones of the last lookup of the request tree,
+ *  the variables are not found if no document was looked up.
+ * @param r Pointer to the request structure, see http_request.h
+ * @param v Variable value
+ * @param data Statistic to expose, see ngx_http_couchlookup_stat_e
+ */
+static ngx_int_t ngx_http_couchlookup_stat_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    static ngx_str_t cache_statuses[] = {
+        ngx_string("BYPASS"),
+        ngx_string("MISS"),
+        ngx_string("HIT"),
+        ngx_string("STALE"),
+        ngx_string("L1")
+    };
+
+    ngx_http_couchlookup_memo_s **list = ngx_http_couchlookup_memo_list(r, 0);
+    if (list == NULL || *list == NULL)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    ngx_http_couchlookup_stats_s *stats = &(*list)->stats;
+    ngx_http_couchlookup_memo_s *memo;
+    ngx_uint_t ops;
+    u_char *p;
+    uint64_t us;
+    const char *name;
+
+    switch (data)
+    {
+        case CL_STAT_TIME:
+        case CL_STAT_PARSE_TIME:
+            // Seconds, microsecond resolution
+            us = data == CL_STAT_TIME ? stats->time_us : stats->parse_us;
+            if ((p = ngx_pnalloc(r->pool, NGX_INT64_LEN + sizeof (".000000"))) == NULL)
+                return NGX_ERROR;
+            v->len = ngx_sprintf(p, "%uL.%06uL", us / 1000000, us % 1000000) - p;
+            v->data = p;
+            break;
+        case CL_STAT_DOC_BYTES:
+            if ((p = ngx_pnalloc(r->pool, NGX_INT64_LEN)) == NULL)
+                return NGX_ERROR;
+            v->len = ngx_sprintf(p, "%uz", stats->doc_bytes) - p;
+            v->data = p;
+            break;
+        case CL_STAT_CACHE_STATUS:
+            v->len = cache_statuses[stats->cache_status].len;
+            v->data = cache_statuses[stats->cache_status].data;
+            break;
+        case CL_STAT_STATUS:
+            // Error name only, e.g. "LCB_KEY_ENOENT (13)" -> "LCB_KEY_ENOENT"
+            name = lcb_strerror_short(stats->status);
+            v->len = strcspn(name, " ");
+            v->data = (u_char *)name;
+            break;
+        case CL_STAT_NODE:
+            v->len = stats->node.len;
+            v->data = stats->node.data;
+            break;
+        case CL_STAT_OPS:
+            // All the lookups of the request, not only the last one
+            for (ops = 0, memo = *list; memo != NULL; memo = memo->next)
+                ops += memo->stats.ops;
+            if ((p = ngx_pnalloc(r->pool, NGX_INT_T_LEN)) == NULL)
+                return NGX_ERROR;
+            v->len = ngx_sprintf(p, "%ui", ops) - p;
+            v->data = p;
+            break;
+        default:
+            v->not_found = 1;
+            return NGX_OK;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+#if (NGX_THREADS)
+/**
+ * @brief Adds a lookup to the pending batch of its location
+ * @details The batch is flushed once full or after the batch window, never
+ *  from here: requests can only be resumed from the event loop.
+ * @param mcf Module configuration of the location
+ * @param t Task context of the request
+ */
+static void ngx_http_couchlookup_batch_add(ngx_http_couchlookup_conf_s *mcf,
+    ngx_http_couchlookup_task_s *t)
+{
+    ngx_http_couchlookup_batch_s *batch = mcf->batch;
+    ngx_event_t *flush = &batch->flush;
+
+    ngx_queue_insert_tail(&batch->pending, &t->queue);
+    batch->npending++;
+
+    if (flush->log == NULL)
+        flush->log = ngx_cycle->log;
+
+    if (batch->npending >= mcf->batch_size)
+    {
+        if (flush->timer_set)
+            ngx_del_timer(flush);
+        ngx_post_event(flush, &ngx_posted_events);
+    }
+    else if (!flush->timer_set && !flush->posted)
+        ngx_add_timer(flush, mcf->batch_window);
+}
+
+/**
+ * @brief Starts a lookup in the thread pool, alone or in the pending batch
+ * @param t Task context of the request
+ * @returns NGX_OK if started, NGX_ERROR if it could not be posted
+ */
+static ngx_int_t ngx_http_couchlookup_start(ngx_http_couchlookup_task_s *t)
+{
+    if (t->task == NULL)
+    {
+        ngx_http_couchlookup_batch_add(t->mcf, t);
+        return NGX_OK;
+    }
+
+    return ngx_thread_task_post(t->mcf->thread_pool, t->task);
+}
+
+/**
+ * @brief Resumes a request suspended by ngx_http_couchlookup_handler
+ * @param t Task context of the request
+ * @param done Whether the lookup ran, otherwise it is done in the worker
+ */
+static void ngx_http_couchlookup_resume(ngx_http_couchlookup_task_s *t, ngx_flag_t done)
+{
+    ngx_http_request_t *r = t->request;
+    ngx_connection_t *c = r->connection;
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    if (done)
+    {
+        ngx_http_couchlookup_l1_put(t->mcf, c->log, &t->ctx->couch_key, t->values,
+            t->generation, t->expire);
+        ngx_http_couchlookup_memo_add(r, t->mcf, &t->ctx->couch_key, t->couch_doc, t->values,
+            &t->stats);
+        t->ctx->done = 1;
+    }
+    else
+        t->ctx->in_worker = 1;
+
+    r->write_event_handler(r);
+    ngx_http_run_posted_requests(c);
+}
+
+/**
+ * @brief Resumes a waiting lookup which could not be started, see ngx_http_couchlookup_release
+ * @param ev Resume event of the task
+ */
+static void ngx_http_couchlookup_resume_handler(ngx_event_t *ev)
+{
+    ngx_http_couchlookup_resume(ev->data, 0);
+}
+
+/**
+ * @brief Releases the in-flight limit held by a lookup, starting waiting ones
+ * @details Waiting lookups which cannot be started are resumed from a posted
+ *  event, not from within the request releasing the limit.
+ * @param t Task context of the request
+ * @param done Whether the lookup ran, its round trip adapts the limit
+ */
+static void ngx_http_couchlookup_release(ngx_http_couchlookup_task_s *t, ngx_flag_t done)
+{
+    ngx_http_cllimit_node_s *node = t->node;
+    if (node == NULL)
+        return;
+    t->node = NULL;
+
+    // The node the thread's instance mapped the key to, its own map is up to date
+    ngx_http_couchlookup_conf_s *mcf = t->mcf;
+    if (done && t->vbucket >= 0 && t->stats.cluster == t->cluster && t->stats.node.len > 0
+        && ngx_memn2cmp(t->stats.node.data, node->name.data, t->stats.node.len,
+            node->name.len) != 0)
+    {
+        ngx_http_couchlookup_main_conf_s *cmcf =
+            ngx_http_get_module_main_conf(t->request, ngx_http_couchlookup_module);
+        ngx_http_cllimit_node_s *learned = ngx_http_cllimit_node(cmcf->limit,
+            t->request->connection->log, &t->stats.node, mcf->limit_max);
+        if (learned != NULL)
+            t->cluster->routes[t->vbucket] = learned;
+    }
+
+    // Served by the cache zone meanwhile, no round trip to adapt the limit to
+    if (done && t->stats.time_us > 0)
+        ngx_http_cllimit_release(node, t->stats.time_us / 1000,
+            t->stats.status != LCB_SUCCESS && t->stats.status != LCB_KEY_ENOENT,
+            mcf->limit_max, mcf->limit_latency);
+    else
+        ngx_http_cllimit_cancel(node);
+
+    // Waiting lookups can come from any location
+    while (!ngx_queue_empty(&node->waiting))
+    {
+        ngx_http_couchlookup_task_s *w = ngx_queue_data(ngx_queue_head(&node->waiting),
+            ngx_http_couchlookup_task_s, queue);
+        if (ngx_http_cllimit_acquire(node, w->mcf->limit_max) != NGX_OK)
+            break;
+
+        ngx_queue_remove(&w->queue);
+        node->nwaiting--;
+
+        if (ngx_http_couchlookup_start(w) == NGX_OK)
+        {
+            w->node = node;
+            continue;
+        }
+
+        // Queue overflow, falling back to a blocking lookup
+        ngx_log_error(NGX_LOG_WARN, w->request->connection->log, 0,
+            "Could not post couch lookup to thread pool, looking up in worker");
+        ngx_http_cllimit_cancel(node);
+        w->resume.handler = ngx_http_couchlookup_resume_handler;
+        w->resume.data = w;
+        w->resume.log = w->request->connection->log;
+        ngx_post_event(&w->resume, &ngx_posted_events);
+    }
+}
+
+/**
+ * @brief Thread pool task, runs the blocking lookup
+ * @param data Task context
+ * @param log Thread pool log
+ */
+static void ngx_http_couchlookup_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_couchlookup_task_s *t = data;
+
+    ngx_http_couchlookup_thread_s *thr = ngx_http_couchlookup_thread_get(log);
+    if (thr == NULL)
+        return;
+
+    ngx_http_couchlookup_fetch_s fetch = { .pool = t->pool, .couch_key = &t->ctx->couch_key };
+    ngx_http_couchlookup_fetch_clusters(thr, log, t->mcf, &fetch, 1);
+
+    uint64_t parse_start = lcw_clock_us();
+    time_t valid = t->mcf->cache_valid;
+    ngx_str_t *values = ngx_pcalloc(t->pool, sizeof (ngx_str_t) * t->mcf->nvars);
+    if (values != NULL
+        && ngx_http_couchlookup_parse(&thr->tokens, log, t->mcf, &t->ctx->couch_key,
+            fetch.couch_doc, values, &valid) == NGX_OK)
+        t->values = values;
+    fetch.stats.parse_us = lcw_clock_us() - parse_start;
+    ngx_http_couchlookup_store(t->mcf, &fetch, valid);
+
+    t->couch_doc = fetch.couch_doc;
+    t->generation = fetch.generation;
+    t->expire = fetch.expire;
+    t->stats = fetch.stats;
+}
+
+/**
+ * @brief Thread pool task completion, resumes the request in the event loop
+ * @param ev Task event
+ */
+static void ngx_http_couchlookup_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_http_couchlookup_task_s *t = ev->data;
+
+    ngx_http_couchlookup_release(t, 1);
+    ngx_http_couchlookup_resume(t, 1);
+}
+
+/**
+ * @brief Thread pool task of a batch, runs the blocking lookups together
+ * @param data Batch task context
+ * @param log Thread pool log
+ */
+static void ngx_http_couchlookup_batch_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_couchlookup_batch_task_s *bt = data;
+
+    ngx_http_couchlookup_thread_s *thr = ngx_http_couchlookup_thread_get(log);
+    if (thr == NULL)
+        return;
+
+    ngx_http_couchlookup_fetch_s fetches[bt->ntasks];
+    ngx_uint_t i;
+    for (i = 0; i < bt->ntasks; ++i)
+    {
+        fetches[i].pool = bt->tasks[i]->pool;
+        fetches[i].couch_key = &bt->tasks[i]->ctx->couch_key;
+    }
+
+    ngx_http_couchlookup_fetch_clusters(thr, log, bt->mcf, fetches, bt->ntasks);
+
+    for (i = 0; i < bt->ntasks; ++i)
+    {
+        ngx_http_couchlookup_task_s *t = bt->tasks[i];
+
+        uint64_t parse_start = lcw_clock_us();
+        time_t valid = bt->mcf->cache_valid;
+        ngx_str_t *values = ngx_pcalloc(t->pool, sizeof (ngx_str_t) * bt->mcf->nvars);
+        if (values != NULL
+            && ngx_http_couchlookup_parse(&thr->tokens, log, bt->mcf, fetches[i].couch_key,
+                fetches[i].couch_doc, values, &valid) == NGX_OK)
+            t->values = values;
+        fetches[i].stats.parse_us = lcw_clock_us() - parse_start;
+        ngx_http_couchlookup_store(bt->mcf, &fetches[i], valid);
+
+        t->couch_doc = fetches[i].couch_doc;
+        t->generation = fetches[i].generation;
+        t->expire = fetches[i].expire;
+        t->stats = fetches[i].stats;
+    }
+}
+
+/**
+ * @brief Thread pool task completion of a batch, resumes all its requests
+ * @param ev Batch task event
+ */
+static void ngx_http_couchlookup_batch_event_handler(ngx_event_t *ev)
+{
+    ngx_http_couchlookup_batch_task_s *bt = ev->data;
+
+    ngx_uint_t i;
+    for (i = 0; i < bt->ntasks; ++i)
+    {
+        ngx_http_couchlookup_release(bt->tasks[i], 1);
+        ngx_http_couchlookup_resume(bt->tasks[i], 1);
+    }
+
+    // The task itself lives in this pool, nginx does not touch it after this handler
+    ngx_destroy_pool(bt->pool);
+}
+
+/**
+ * @brief Posts pending lookups of a location to the thread pool, by batches
+ * @details Called when the batch window is over or the batch is full.
+ * @param ev Batch flush event, `data` is the module configuration
+ */
+static void ngx_http_couchlookup_batch_flush(ngx_event_t *ev)
+{
+    ngx_http_couchlookup_conf_s *mcf = ev->data;
+    ngx_http_couchlookup_batch_s *batch = mcf->batch;
+
+    if (ev->timer_set)
+        ngx_del_timer(ev);
+
+    while (batch->npending > 0)
+    {
+        ngx_uint_t n = ngx_min(batch->npending, mcf->batch_size);
+        ngx_http_couchlookup_task_s *tasks[n];
+        ngx_uint_t i;
+        for (i = 0; i < n; ++i)
+        {
+            ngx_queue_t *q = ngx_queue_head(&batch->pending);
+            ngx_queue_remove(q);
+            tasks[i] = ngx_queue_data(q, ngx_http_couchlookup_task_s, queue);
+        }
+        batch->npending -= n;
+
+        ngx_pool_t *pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+        ngx_thread_task_t *task = pool == NULL ? NULL
+            : ngx_thread_task_alloc(pool, sizeof (ngx_http_couchlookup_batch_task_s));
+        ngx_http_couchlookup_batch_task_s *bt = task == NULL ? NULL : task->ctx;
+        if (bt != NULL && (bt->tasks = ngx_palloc(pool, sizeof (tasks))) != NULL)
+        {
+            ngx_memcpy(bt->tasks, tasks, sizeof (tasks));
+            bt->ntasks = n;
+            bt->mcf = mcf;
+            bt->pool = pool;
+
+            task->handler = ngx_http_couchlookup_batch_thread_handler;
+            task->event.data = bt;
+            task->event.handler = ngx_http_couchlookup_batch_event_handler;
+
+            if (ngx_thread_task_post(mcf->thread_pool, task) == NGX_OK)
+                continue;
+        }
+
+        // Allocation failure or queue overflow, falling back to blocking lookups
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+            "Could not post batch of %ui couch lookups to thread pool, looking up in worker", n);
+        if (pool != NULL)
+            ngx_destroy_pool(pool);
+
+        for (i = 0; i < n; ++i)
+        {
+            ngx_http_couchlookup_release(tasks[i], 0);
+            ngx_http_couchlookup_resume(tasks[i], 0);
+        }
+    }
+}
+
+/**
+ * @brief Returns the limit of the node a lookup goes to
+ * @details Keys are mapped by vBucket in the cluster the lookup goes to. The
+ *  worker's instance only maps a vBucket the first time: its cluster map is
+ *  not refreshed while lookups run in the thread pool. Routes are then
+ *  learned from the nodes the threads' instances sent lookups to, see
+ *  ngx_http_couchlookup_release.
+ * @param r Pointer to the request structure
+ * @param mcf Module configuration
+ * @param t Task context of the request, `cluster` and `vbucket` are set
+ * @returns Node limit, NULL on allocation failure
+ */
+static ngx_http_cllimit_node_s *ngx_http_couchlookup_route(ngx_http_request_t *r,
+    ngx_http_couchlookup_conf_s *mcf, ngx_http_couchlookup_task_s *t)
+{
+    ngx_http_couchlookup_main_conf_s *cmcf =
+        ngx_http_get_module_main_conf(r, ngx_http_couchlookup_module);
+    ngx_http_couchlookup_instance_s *cluster = ngx_http_couchlookup_cluster_pick(mcf, NULL);
+    ngx_str_t *couch_key = &t->ctx->couch_key;
+
+    unsigned nvbuckets = 0;
+    int vbucket = lcw_get_vbucket(cluster->instance, couch_key, &nvbuckets);
+    if (vbucket >= 0 && cluster->routes == NULL)
+    {
+        // Never freed, as node limits
+        cluster->routes = ngx_calloc(sizeof (ngx_http_cllimit_node_s *) * nvbuckets,
+            r->connection->log);
+        cluster->nroutes = cluster->routes == NULL ? 0 : nvbuckets;
+    }
+
+    t->cluster = cluster;
+    t->vbucket = vbucket >= 0 && (ngx_uint_t)vbucket < cluster->nroutes ? vbucket : -1;
+    if (t->vbucket >= 0 && cluster->routes[t->vbucket] != NULL)
+        return cluster->routes[t->vbucket];
+
+    ngx_str_t name = { .data = (u_char *)lcw_get_node(cluster->instance, couch_key), .len = 0 };
+    if (name.data != NULL)
+        name.len = ngx_strlen(name.data);
+    ngx_http_cllimit_node_s *node = ngx_http_cllimit_node(cmcf->limit, r->connection->log,
+        &name, mcf->limit_max);
+    if (node != NULL && t->vbucket >= 0 && name.len > 0)
+        cluster->routes[t->vbucket] = node;
+
+    return node;
+}
+
+/**
+ * @brief Checks the in-flight limit of the node of a lookup, if configured
+ * @details Lookups over the limit are queued, rejected or served from the
+ *  cache zone, see ngx_http_couchlookup_overflow_e. Rejected and served ones
+ *  are memoized right away. Lookups the cache zone can serve are admitted
+ *  without taking any in-flight slot.
+ * @param r Pointer to the request structure
+ * @param mcf Module configuration
+ * @param t Task context of the request, `node` is set if the lookup is admitted
+ * @returns NGX_OK if admitted, NGX_AGAIN if queued, NGX_DECLINED if memoized,
+ *  NGX_ERROR on allocation failure
+ */
+static ngx_int_t ngx_http_couchlookup_admit(ngx_http_request_t *r,
+    ngx_http_couchlookup_conf_s *mcf, ngx_http_couchlookup_task_s *t)
+{
+    if (mcf->limit_max == 0)
+        return NGX_OK;
+
+    ngx_str_t *couch_key = &t->ctx->couch_key;
+    if (mcf->cache_zone != NULL && ngx_http_clcache_fresh(mcf->cache_zone, couch_key))
+        return NGX_OK;
+
+    ngx_http_cllimit_node_s *node = ngx_http_couchlookup_route(r, mcf, t);
+    if (node == NULL)
+        return NGX_ERROR;
+
+    if (ngx_http_cllimit_acquire(node, mcf->limit_max) == NGX_OK)
+    {
+        t->node = node;
+        return NGX_OK;
+    }
+
+    // Bounded, waiting lookups hold requests in memory
+    if (mcf->limit_overflow == CL_OVERFLOW_QUEUE && node->nwaiting < mcf->limit_max)
+    {
+        ngx_queue_insert_tail(&node->waiting, &t->queue);
+        node->nwaiting++;
+        return NGX_AGAIN;
+    }
+
+    ngx_http_couchlookup_stats_s stats = { .cache_status = CL_CACHE_BYPASS, .status = LCB_EBUSY };
+    lcw_get_result_s *couch_doc = NULL;
+    ngx_str_t *values = NULL;
+
+    ngx_http_clcache_doc_s cached;
+    if (mcf->limit_overflow == CL_OVERFLOW_STALE && mcf->cache_zone != NULL
+        && ngx_http_clcache_lookup(mcf->cache_zone, r->pool, couch_key, &cached) != CLC_MISS)
+    {
+        if ((couch_doc = ngx_http_couchlookup_cached_doc(r->pool, &cached)) == NULL)
+            return NGX_ERROR;
+        stats.cache_status = cached.expire > ngx_time() ? CL_CACHE_HIT : CL_CACHE_STALE;
+        stats.status = LCB_SUCCESS;
+        stats.doc_bytes = cached.len;
+
+        if ((values = ngx_pcalloc(r->pool, sizeof (ngx_str_t) * mcf->nvars)) == NULL)
+            return NGX_ERROR;
+        if (ngx_http_couchlookup_parse(&ngx_http_couchlookup_worker_tokens,
+                r->connection->log, mcf, couch_key, couch_doc, values, NULL) != NGX_OK)
+            values = NULL;
+    }
+    else
+    {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+            "Couch lookup of \"%V\" rejected, node \"%V\" is at its limit of %ui lookups",
+            couch_key, &node->name, ngx_min(node->limit / CLL_SCALE, mcf->limit_max));
+
+        if ((couch_doc = ngx_pcalloc(r->pool, sizeof (lcw_get_result_s))) == NULL)
+            return NGX_ERROR;
+        couch_doc->status = LCB_EBUSY;
+        couch_doc->pool = r->pool;
+    }
+
+    if (ngx_http_couchlookup_memo_add(r, mcf, couch_key, couch_doc, values, &stats) == NULL)
+        return NGX_ERROR;
+
+    return NGX_DECLINED;
+}
+
+/**
+ * @brief Rewrite phase handler, offloads the lookup to the thread pool
+ * @details Runs before the rewrite module's handler, so that variables are
+ *  available in `if`, `return`, etc. without blocking the worker.
+ * @param r Pointer to the request structure
+ * @returns NGX_DONE while the lookup is pending, NGX_DECLINED otherwise
+ */
+static ngx_int_t ngx_http_couchlookup_handler(ngx_http_request_t *r)
+{
+    ngx_http_couchlookup_conf_s *mcf = ngx_http_get_module_loc_conf(r, ngx_http_couchlookup_module);
+    if (mcf->thread_pool == NULL || mcf->complex_couch_key == NULL)
+        return NGX_DECLINED;
+
+    ngx_http_couchlookup_ctx_s *ctx = ngx_http_get_module_ctx(r, ngx_http_couchlookup_module);
+    if (ctx != NULL) // woken up before completion, or already done
+        return ctx->done || ctx->in_worker ? NGX_DECLINED : NGX_DONE;
+
+    ngx_str_t couch_key;
+    if (ngx_http_complex_value(r, mcf->complex_couch_key, &couch_key) != NGX_OK)
+        return NGX_ERROR;
+
+    // Already looked up in this request tree, e.g. before an internal redirect
+    if (ngx_http_couchlookup_memo_find(r, mcf, &couch_key) != NULL)
+        return NGX_DECLINED;
+
+    // Hot keys are served from the worker's L1 table, no thread pool round trip
+    CL_PROBE2(lookup__start, couch_key.data, couch_key.len);
+
+    ngx_str_t *values = ngx_http_couchlookup_l1_get(r, mcf, &couch_key);
+    if (values != NULL)
+    {
+        ngx_http_couchlookup_stats_s stats = { .cache_status = CL_CACHE_L1, .status = LCB_SUCCESS };
+        ngx_http_couchlookup_memo_add(r, mcf, &couch_key, NULL, values, &stats);
+        return NGX_DECLINED;
+    }
+
+    if ((ctx = ngx_pcalloc(r->pool, sizeof (ngx_http_couchlookup_ctx_s))) == NULL)
+        return NGX_ERROR;
+    ctx->couch_key = couch_key;
+
+    // Batched lookups are posted by ngx_http_couchlookup_batch_flush in a shared task
+    ngx_thread_task_t *task = NULL;
+    ngx_http_couchlookup_task_s *t;
+    if (mcf->batch != NULL)
+        t = ngx_pcalloc(r->pool, sizeof (ngx_http_couchlookup_task_s));
+    else
+    {
+        task = ngx_thread_task_alloc(r->pool, sizeof (ngx_http_couchlookup_task_s));
+        t = task == NULL ? NULL : task->ctx;
+    }
+    if (t == NULL)
+        return NGX_ERROR;
+
+    t->mcf = mcf;
+    t->request = r;
+    t->ctx = ctx;
+    t->couch_doc = NULL;
+    t->values = NULL;
+    t->generation = 0;
+    t->expire = 0;
+    ngx_memzero(&t->stats, sizeof (ngx_http_couchlookup_stats_s));
+    t->task = task;
+    t->node = NULL;
+    t->cluster = NULL;
+    t->vbucket = -1;
+    if (task != NULL)
+    {
+        task->handler = ngx_http_couchlookup_thread_handler;
+        task->event.data = t;
+        task->event.handler = ngx_http_couchlookup_thread_event_handler;
+    }
+
+    // The thread gets its own pool, request pool allocations are not thread-safe
+    if ((t->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, r->connection->log)) == NULL)
+        return NGX_ERROR;
+
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL)
+    {
+        ngx_destroy_pool(t->pool);
+        return NGX_ERROR;
+    }
+    cln->handler = (ngx_pool_cleanup_pt)ngx_destroy_pool;
+    cln->data = t->pool;
+
+    ngx_int_t rc = ngx_http_couchlookup_admit(r, mcf, t);
+    if (rc == NGX_OK && ngx_http_couchlookup_start(t) != NGX_OK)
+    {
+        // Queue overflow, falling back to a blocking lookup in the variable handler
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+            "Could not post couch lookup to thread pool, looking up in worker");
+        ngx_http_couchlookup_release(t, 0); // starts lookups waiting for the slot
+        return NGX_DECLINED;
+    }
+    if (rc != NGX_OK && rc != NGX_AGAIN) // served on overflow, or failure
+        return rc;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_couchlookup_module);
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_DONE;
+}
+#endif
+
+/**
+ * @brief Returns the cluster of some creds, bootstrapped once
+ * @details Locations with identical creds share the same instance, and the
+ *  same health whatever their creds file. Clusters which cannot be
+ *  bootstrapped are failed over, with a NULL instance (see
+ *  ngx_http_couchlookup_cluster_instance).
+ * @param cf Module configuration structure pointer
+ * @param creds Parsed credentials, kept in the configuration pool
+ * @returns Cluster or NULL on allocation failure
+ */
+static ngx_http_couchlookup_instance_s *ngx_http_couchlookup_instance(ngx_conf_t *cf,
+    lcw_creds_s *creds)
+{
+    ngx_http_couchlookup_main_conf_s *cmcf =
+        ngx_http_conf_get_module_main_conf(cf, ngx_http_couchlookup_module);
+
+    ngx_http_couchlookup_instance_s **inst = cmcf->instances.elts;
+    ngx_uint_t i;
+    for (i = 0; i < cmcf->instances.nelts; ++i)
+    {
+        if (ngx_strcmp(inst[i]->creds.host, creds->host) == 0
+            && ngx_strcmp(inst[i]->creds.bucket, creds->bucket) == 0
+            && ngx_strcmp(inst[i]->creds.username, creds->username) == 0
+            && ngx_strcmp(inst[i]->creds.password, creds->password) == 0)
+            return inst[i];
+    }
+
+    // Allocated apart, locations keep pointers to it while the array grows
+    ngx_http_couchlookup_instance_s *cluster = ngx_pcalloc(cf->pool,
+        sizeof (ngx_http_couchlookup_instance_s));
+    if (cluster == NULL || (inst = ngx_array_push(&cmcf->instances)) == NULL)
+        return NULL;
+    cluster->creds = *creds;
+    if ((cluster->instance = lcw_init(creds)) == NULL)
+        cluster->retry = ngx_time() + FAILOVER_RETRY_DEFAULT;
+    *inst = cluster;
+
+    return cluster;
+}
+
+/**
+ * @brief Configuration setup for credentials file
+ * @param cf Module configuration structure pointer
+ * @param cmd Module directives structure pointer
+ * @param conf Module configuration structure pointer
+ * @returns string Status of the configuration setup
+ */
+static char *ngx_http_couchlookup_creds(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    // Module config
+    ngx_http_couchlookup_conf_s *mcf = conf;
+
+    ngx_str_t *value = cf->args->elts;
+    ngx_str_t *creds_file = &value[1]; // value[0] is the command name
+
+    char *rc = NGX_CONF_ERROR;
+    char *buf = NULL;
 
     ngx_fd_t fd = ngx_open_file(creds_file->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
     if (fd == NGX_INVALID_FILE)
     {
-        ngx_log_stderr(0, "Could not open file: %*s",
-            creds_file->len, creds_file->data);
-        goto failure;
+        ngx_log_stderr(0, "Could not open file: %*s",
+            creds_file->len, creds_file->data);
+        goto failure;
+    }
+
+    ngx_file_info_t fi;
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR)
+    {
+        ngx_log_stderr(0, "Could not access file info for: %*s",
+            creds_file->len, creds_file->data);
+        goto failure;
+    }
+
+    // Kept in the configuration pool, credentials are needed by thread pool instances
+    size_t size = ngx_file_size(&fi);
+    buf = ngx_pnalloc(cf->pool, size + 1);
+    if (buf == NULL)
+        goto failure;
+    buf[size] = '\0';
+
+    ssize_t n = ngx_read_fd(fd, buf, size);
+    if (n == -1)
+    {
+        ngx_log_stderr(0, "Could not read from file descriptor: %*s",
+            creds_file->len, creds_file->data);
+        goto failure;
+    }
+    else if ((size_t) n != size)
+    {
+        ngx_log_stderr(0, "File descriptor has read only %z of %O from %*s",
+            n, size, creds_file->len, creds_file->data);
+        goto failure;
+    }
+
+    ngx_http_couchlookup_main_conf_s *cmcf =
+        ngx_http_conf_get_module_main_conf(cf, ngx_http_couchlookup_module);
+
+    ngx_array_t *clusters = ngx_array_create(cf->pool, 1, sizeof (ngx_http_couchlookup_cluster_s));
+    if (clusters == NULL)
+        goto failure;
+
+    // One cluster per line, empty lines and # comments are skipped
+    char *line, *next_line;
+    for (line = buf; line != NULL; line = next_line)
+    {
+        if ((next_line = strchr(line, '\n')) != NULL)
+            *next_line++ = '\0';
+        line += strspn(line, " \t\r");
+        if (*line == '\0' || *line == '#')
+            continue;
+
+        ngx_http_couchlookup_cluster_s *cluster = ngx_array_push(clusters);
+        if (cluster == NULL)
+            goto failure;
+        ngx_memzero(cluster, sizeof (ngx_http_couchlookup_cluster_s));
+        lcw_creds_s creds;
+        ngx_memzero(&creds, sizeof (lcw_creds_s));
+
+        SET_FIRST_CREDS_TOK(creds.host, line);
+        SET_NEXT_CREDS_TOK(creds.bucket);
+        SET_NEXT_CREDS_TOK(creds.username);
+        SET_NEXT_CREDS_TOK(creds.password);
+
+        char *priority = strtok(NULL, _CREDS_TOKEN_DELIM);
+        if (priority != NULL)
+        {
+            cluster->priority = ngx_atoi((u_char *)priority, ngx_strlen(priority));
+            if (cluster->priority == NGX_ERROR)
+            {
+                ngx_log_stderr(0, "Invalid priority \"%s\" in %*s",
+                    priority, creds_file->len, creds_file->data);
+                goto failure;
+            }
+        }
+
+        if (cmcf->config_cache.len > 0)
+        {
+            size_t len = cmcf->config_cache.len + ngx_strlen(creds.bucket)
+                + ngx_strlen(creds.host) + sizeof ("/@.json");
+            if ((creds.config_cache = ngx_pnalloc(cf->pool, len)) == NULL)
+                goto failure;
+            ngx_sprintf((u_char *)creds.config_cache, CONFIG_CACHE_FILE_TPL,
+                &cmcf->config_cache, creds.bucket, creds.host);
+        }
+
+        cluster->instance = ngx_http_couchlookup_instance(cf, &creds);
+        if (cluster->instance == NULL)
+            goto failure;
+    }
+
+    if (clusters->nelts == 0)
+    {
+        ngx_log_stderr(0, "No cluster in creds file: %*s",
+            creds_file->len, creds_file->data);
+        goto failure;
+    }
+
+    // Insertion sort, clusters of the same priority keep the order of the file
+    ngx_http_couchlookup_cluster_s *cl = clusters->elts, tmp;
+    ngx_uint_t i, j;
+    for (i = 1; i < clusters->nelts; ++i)
+    {
+        tmp = cl[i];
+        for (j = i; j > 0 && cl[j - 1].priority > tmp.priority; --j)
+            cl[j] = cl[j - 1];
+        cl[j] = tmp;
+    }
+
+    // Others can be down, that is what failing over is for
+    if (cl[0].instance->instance == NULL)
+    {
+        ngx_log_stderr(0, "Could not bootstrap cluster \"%s\" of %*s, first by priority",
+            cl[0].instance->creds.host, creds_file->len, creds_file->data);
+        goto failure;
+    }
+    for (i = 1; i < clusters->nelts; ++i)
+        if (cl[i].instance->instance == NULL)
+            ngx_log_stderr(0, "Could not bootstrap cluster \"%s\" of %*s, failed over " \
+                "until bootstrapped by the workers", cl[i].instance->creds.host,
+                creds_file->len, creds_file->data);
+
+    mcf->clusters = clusters;
+
+    rc = NGX_CONF_OK;
+
+failure:
+    if (fd != NGX_INVALID_FILE && ngx_close_file(fd) == NGX_FILE_ERROR)
+        ngx_log_stderr(0, "Could not close file descriptor for file: %*s",
+            creds_file->len, creds_file->data);
+
+    return rc;
+}
+
+/**
+ * @brief Declares a variable of the document, in the next value slot
+ * @param cf Module configuration structure pointer
+ * @param mcf Module configuration of the block
+ * @param var_name Variable name, allocated in the configuration pool
+ * @returns Declared variable, NULL on failure
+ */
+static ngx_http_aqvar_s *ngx_http_couchlookup_declare(ngx_conf_t *cf,
+    ngx_http_couchlookup_conf_s *mcf, ngx_str_t *var_name)
+{
+    // Returns the existing variable when declared by another location
+    ngx_http_variable_t *var = ngx_http_add_variable(cf, var_name,
+        NGX_HTTP_VAR_CHANGEABLE|NGX_HTTP_VAR_NOCACHEABLE);
+    if (var == NULL)
+        return NULL;
+    var->get_handler = ngx_http_couchlookup_variable_handler;
+    var->data = 0;
+
+    ngx_http_aqvar_s *aqvar = ngx_palloc(cf->pool, sizeof (ngx_http_aqvar_s));
+    if (aqvar == NULL)
+        return NULL;
+    aqvar->name = var_name;
+    aqvar->slot = mcf->nvars++;
+    // Calling ngx_http_get_variable_index registers the variable index in request->variables
+    aqvar->index = ngx_http_get_variable_index(cf, var_name);
+    if (ngx_http_hashtb_add(mcf->aqvars, aqvar->name, aqvar) == HTB_ADD_FAILURE)
+        return NULL;
+
+    return aqvar;
+}
+
+/**
+ * @brief Configuration setup for failover between the clusters of a creds file
+ * @param cf Module configuration structure pointer
+ * @param cmd Module directives structure pointer
+ * @param conf Module configuration structure pointer
+ * @returns string Status of the configuration setup
+ */
+static char *ngx_http_couchlookup_failover(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    // Module config, the creds can be inherited: clusters are resolved on merge
+    ngx_http_couchlookup_conf_s *mcf = conf;
+
+    ngx_str_t *value = cf->args->elts;
+    mcf->failover_failures = FAILOVER_FAILURES_DEFAULT;
+    mcf->failover_latency = 0;
+    mcf->failover_retry = FAILOVER_RETRY_DEFAULT;
+
+    // Handling parameters: latency=, failures=, retry=
+    ngx_uint_t i;
+    for (i = 1; i < cf->args->nelts; ++i)
+    {
+        if (ngx_strncmp(value[i].data, "latency=", 8) == 0)
+        {
+            ngx_str_t latency = { .data = value[i].data + 8, .len = value[i].len - 8 };
+            mcf->failover_latency = ngx_parse_time(&latency, 0);
+            if (mcf->failover_latency == (ngx_msec_t)NGX_ERROR || mcf->failover_latency == 0)
+            {
+                ngx_log_stderr(0, "Invalid failover latency \"%V\"", &latency);
+                return NGX_CONF_ERROR;
+            }
+        }
+        else if (ngx_strncmp(value[i].data, "failures=", 9) == 0)
+        {
+            ngx_int_t failures = ngx_atoi(value[i].data + 9, value[i].len - 9);
+            if (failures == NGX_ERROR || failures < 1)
+            {
+                ngx_log_stderr(0, "Invalid failover failures \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            mcf->failover_failures = failures;
+        }
+        else if (ngx_strncmp(value[i].data, "retry=", 6) == 0)
+        {
+            ngx_str_t retry = { .data = value[i].data + 6, .len = value[i].len - 6 };
+            mcf->failover_retry = ngx_parse_time(&retry, 1);
+            if (mcf->failover_retry == (time_t)NGX_ERROR || mcf->failover_retry == 0)
+            {
+                ngx_log_stderr(0, "Invalid failover retry \"%V\"", &retry);
+                return NGX_CONF_ERROR;
+            }
+        }
+        else
+        {
+            ngx_log_stderr(0, "Invalid couchlookup_failover parameter \"%V\", expecting " \
+                "latency=TIME, failures=NUMBER or retry=TIME", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief Configuration setup for persisted cluster topologies
+ * @param cf Module configuration structure pointer
+ * @param cmd Module directives structure pointer
+ * @param conf Module main configuration structure pointer
+ * @returns string Status of the configuration setup
+ */
+static char *ngx_http_couchlookup_config_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_couchlookup_main_conf_s *cmcf = conf;
+    if (cmcf->config_cache.len > 0)
+    {
+        ngx_log_stderr(0, "Duplicate couchlookup_config_cache");
+        return NGX_CONF_ERROR;
+    }
+
+    // Instances are bootstrapped by couchlookup_creds
+    if (cmcf->instances.nelts > 0)
+    {
+        ngx_log_stderr(0, "couchlookup_config_cache needs to be placed before couchlookup_creds");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_t *value = cf->args->elts;
+    cmcf->config_cache = value[1];
+    if (ngx_conf_full_name(cf->cycle, &cmcf->config_cache, 0) != NGX_OK)
+        return NGX_CONF_ERROR;
+
+    ngx_file_info_t fi;
+    if (ngx_file_info(cmcf->config_cache.data, &fi) == NGX_FILE_ERROR || !ngx_is_dir(&fi))
+    {
+        ngx_log_stderr(0, "Topology cache \"%V\" needs to be a directory", &cmcf->config_cache);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief Configuration setup for couch key and variables to declare
+ * @param cf Module configuration structure pointer
+ * @param cmd Module directives structure pointer
+ * @param conf Module configuration structure pointer
+ * @returns string Status of the configuration setup
+ */
+static char *ngx_http_couchlookup_read_doc(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    // Module config, creds can be inherited: checked on merge
+    ngx_http_couchlookup_conf_s *mcf = conf;
+
+    mcf->complex_couch_key = ngx_palloc(cf->pool, sizeof (ngx_http_complex_value_t));
+    if (mcf->complex_couch_key == NULL)
+        return NGX_CONF_ERROR;
+
+    ngx_str_t *value = cf->args->elts;
+
+    // Handling first parameter: couchbase key
+    if (ngx_http_script_variables_count(&value[1]) != 1)
+    {
+        ngx_log_stderr(0, "couchlookup_read_doc will only interpret one variable");
+        return NGX_CONF_ERROR;
     }
 
-    ngx_file_info_t fi;
-    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR)
+    ngx_http_compile_complex_value_t ccv;
+    ngx_memzero(&ccv, sizeof (ngx_http_compile_complex_value_t));
+    ccv.cf = cf;
+    ccv.value = &value[1]; // value[0] is the command name
+    ccv.complex_value = mcf->complex_couch_key;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK)
+        return NGX_CONF_ERROR;
+
+    // Handling second parameter: variable names
+    char *name_tok = strtok((char *)value[2].data, ",");
+    do
     {
-        ngx_log_stderr(0, "Could not access file info for: %*s",
-            creds_file->len, creds_file->data);
-        goto failure;
+        ngx_str_t *var_name = ngx_palloc(cf->pool, sizeof (ngx_str_t));
+        if (var_name == NULL)
+            return NGX_CONF_ERROR;
+        var_name->len = snprintf(NULL, 0, VAR_NAME_TPL, name_tok);
+        var_name->data = ngx_palloc(cf->pool, sizeof (u_char) * (var_name->len + 1));
+        if (sprintf((char *)var_name->data, VAR_NAME_TPL, name_tok) < 0)
+            return NGX_CONF_ERROR;
+
+        if (ngx_http_couchlookup_declare(cf, mcf, var_name) == NULL)
+            return NGX_CONF_ERROR;
+
+        name_tok = strtok(NULL, ",");
     }
+    while (name_tok != NULL);
 
-    size_t size = ngx_file_size(&fi);
-    buf = ngx_alloc(size, cf->log);
-    if (buf == NULL)
-        goto failure;
+    return NGX_CONF_OK;
+}
 
-    ssize_t n = ngx_read_fd(fd, buf, size);
-    if (n == -1)
+/**
+ * @brief Configuration setup for the value map of a field
+ * @param cf Module configuration structure pointer
+ * @param cmd Module directives structure pointer
+ * @param conf Module configuration structure pointer
+ * @returns string Status of the configuration setup
+ */
+static char *ngx_http_couchlookup_enum(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    // Module config, the field has to be declared in this block
+    ngx_http_couchlookup_conf_s *mcf = conf;
+    if (mcf->complex_couch_key == NULL)
     {
-        ngx_log_stderr(0, "Could not read from file descriptor: %*s",
-            creds_file->len, creds_file->data);
-        goto failure;
+        ngx_log_stderr(0, "Couch document not found. Hint: couchlookup_enum needs " \
+            "couchlookup_read_doc before it in the same block.");
+        return NGX_CONF_ERROR;
     }
-    else if ((size_t) n != size)
+
+    ngx_str_t *value = cf->args->elts;
+    ngx_uint_t nvalues = cf->args->nelts - 2;
+    if (nvalues > ENUM_MAX_VALUES)
     {
-        ngx_log_stderr(0, "File descriptor has read only %z of %O from %*s",
-            n, size, creds_file->len, creds_file->data);
-        goto failure;
+        ngx_log_stderr(0, "Too many values for field \"%V\" of couchlookup_enum, " \
+            "expecting at most %d", &value[1], ENUM_MAX_VALUES);
+        return NGX_CONF_ERROR;
     }
 
-    lcw_creds_s creds;
-    ngx_memzero(&creds, sizeof (creds));
+    // Handling first parameter: field, declared by couchlookup_read_doc
+    size_t var_len = snprintf(NULL, 0, VAR_NAME_TPL, (char *)value[1].data);
+    char buf_varname[var_len + 1];
+    sprintf(buf_varname, VAR_NAME_TPL, (char *)value[1].data);
+    ngx_str_t field_name = { .data = (u_char *)buf_varname, .len = var_len };
 
-    SET_FIRST_CREDS_TOK(creds.host, buf);
-    SET_NEXT_CREDS_TOK(creds.bucket);
-    SET_NEXT_CREDS_TOK(creds.username);
-    SET_NEXT_CREDS_TOK(creds.password);
+    ngx_http_aqvar_s *field = ngx_http_hashtb_get(mcf->aqvars, &field_name);
+    if (field == NULL)
+    {
+        ngx_log_stderr(0, "Field \"%V\" of couchlookup_enum needs to be declared " \
+            "by couchlookup_read_doc", &value[1]);
+        return NGX_CONF_ERROR;
+    }
 
-    mcf->couch_instance = lcw_init(cf->pool, &creds);
-    if (mcf->couch_instance == NULL)
-        goto failure;
+    if (mcf->enums == NULL
+        && (mcf->enums = ngx_array_create(cf->pool, 1, sizeof (ngx_http_couchlookup_enum_s))) == NULL)
+        return NGX_CONF_ERROR;
 
-    rc = NGX_CONF_OK;
+    ngx_http_couchlookup_enum_s *en = mcf->enums->elts;
+    ngx_uint_t i;
+    for (i = 0; i < mcf->enums->nelts; ++i)
+        if (en[i].slot == field->slot)
+        {
+            ngx_log_stderr(0, "Duplicate couchlookup_enum for field \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+    if ((en = ngx_array_push(mcf->enums)) == NULL)
+        return NGX_CONF_ERROR;
+    en->slot = field->slot;
+    en->nvalues = nvalues;
+
+    // Copied out of cf->args, refilled by the next directive (the data stays in cf->pool)
+    if ((en->values = ngx_palloc(cf->pool, sizeof (ngx_str_t) * nvalues)) == NULL)
+        return NGX_CONF_ERROR;
+    for (i = 0; i < nvalues; ++i)
+        en->values[i] = value[2 + i];
+
+    // Ids are rendered once, mapped values point to them
+    if ((en->ids = ngx_palloc(cf->pool, sizeof (ngx_str_t) * (nvalues + 1))) == NULL)
+        return NGX_CONF_ERROR;
+    for (i = 0; i <= nvalues; ++i)
+    {
+        if ((en->ids[i].data = ngx_pnalloc(cf->pool, NGX_INT_T_LEN)) == NULL)
+            return NGX_CONF_ERROR;
+        en->ids[i].len = ngx_sprintf(en->ids[i].data, "%ui", i) - en->ids[i].data;
+    }
+
+    // Handling the id variable, set along with the fields of the document
+    ngx_str_t *id_name = ngx_palloc(cf->pool, sizeof (ngx_str_t));
+    if (id_name == NULL)
+        return NGX_CONF_ERROR;
+    id_name->len = snprintf(NULL, 0, ENUM_VAR_NAME_TPL, (char *)value[1].data);
+    id_name->data = ngx_palloc(cf->pool, sizeof (u_char) * (id_name->len + 1));
+    if (sprintf((char *)id_name->data, ENUM_VAR_NAME_TPL, (char *)value[1].data) < 0)
+        return NGX_CONF_ERROR;
+
+    if (ngx_http_hashtb_get(mcf->aqvars, id_name) != NULL)
+    {
+        ngx_log_stderr(0, "Variable \"$%V\" of couchlookup_enum is already declared " \
+            "by couchlookup_read_doc", id_name);
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_http_aqvar_s *id = ngx_http_couchlookup_declare(cf, mcf, id_name);
+    if (id == NULL)
+        return NGX_CONF_ERROR;
+    en->id_slot = id->slot;
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief Configuration setup for the shared document cache zone
+ * @param cf Module configuration structure pointer
+ * @param cmd Module directives structure pointer
+ * @param conf Unused, the zone is declared at http level
+ * @returns string Status of the configuration setup
+ */
+static char *ngx_http_couchlookup_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t *value = cf->args->elts;
+
+    // Handling `name:size` parameter
+    u_char *p = (u_char *)ngx_strlchr(value[1].data, value[1].data + value[1].len, ':');
+    if (p == NULL || p == value[1].data)
+    {
+        ngx_log_stderr(0, "Invalid cache zone \"%V\". Syntax: `name:size`.", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_t name = { .data = value[1].data, .len = p - value[1].data };
+    ngx_str_t size_str = { .data = p + 1, .len = value[1].data + value[1].len - p - 1 };
+    ssize_t size = ngx_parse_size(&size_str);
+    if (size == NGX_ERROR || size < (ssize_t)CACHE_ZONE_MIN_SIZE)
+    {
+        ngx_log_stderr(0, "Invalid or too small cache zone size \"%V\"", &size_str);
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_shm_zone_t *shm_zone = ngx_shared_memory_add(cf, &name, size,
+        &ngx_http_couchlookup_module);
+    if (shm_zone == NULL)
+        return NGX_CONF_ERROR;
+
+    if (shm_zone->data != NULL)
+    {
+        ngx_log_stderr(0, "Duplicate cache zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_http_clcache_s *cache = ngx_pcalloc(cf->pool, sizeof (ngx_http_clcache_s));
+    if (cache == NULL)
+        return NGX_CONF_ERROR;
+
+    // Handling optional parameter: compress=lz4
+    if (cf->args->nelts > 2)
+    {
+        if (ngx_strcmp(value[2].data, "compress=lz4") != 0)
+        {
+            ngx_log_stderr(0, "Invalid couchlookup_cache_zone parameter \"%V\", expecting " \
+                "compress=lz4", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+#if (NGX_HTTP_COUCHLOOKUP_LZ4)
+        cache->compress = 1;
+#else
+        ngx_log_stderr(0, "compress=lz4 needs nginx to be configured with COUCHLOOKUP_LZ4=yes");
+        return NGX_CONF_ERROR;
+#endif
+    }
+
+    shm_zone->init = ngx_http_clcache_init_zone;
+    shm_zone->data = cache;
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief Configuration setup for document caching in a location
+ * @param cf Module configuration structure pointer
+ * @param cmd Module directives structure pointer
+ * @param conf Module configuration structure pointer
+ * @returns string Status of the configuration setup
+ */
+static char *ngx_http_couchlookup_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    // Module config
+    ngx_http_couchlookup_conf_s *mcf = conf;
+
+    ngx_str_t *value = cf->args->elts;
+
+    // Zone can be declared after this directive, size is checked at init
+    mcf->cache_zone = ngx_shared_memory_add(cf, &value[1], 0, &ngx_http_couchlookup_module);
+    if (mcf->cache_zone == NULL)
+        return NGX_CONF_ERROR;
+
+    mcf->cache_valid = CACHE_VALID_DEFAULT;
+    if (cf->args->nelts == 3)
+    {
+        mcf->cache_valid = ngx_parse_time(&value[2], 1);
+        if (mcf->cache_valid == (time_t)NGX_ERROR)
+        {
+            ngx_log_stderr(0, "Invalid cache validity \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief Configuration setup for the per-worker L1 table of a location
+ * @param cf Module configuration structure pointer
+ * @param cmd Module directives structure pointer
+ * @param conf Module configuration structure pointer
+ * @returns string Status of the configuration setup
+ */
+static char *ngx_http_couchlookup_cache_l1(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    // Module config, the cache zone can be inherited: checked on merge
+    ngx_http_couchlookup_conf_s *mcf = conf;
+
+    ngx_str_t *value = cf->args->elts;
+
+    ngx_int_t entries = ngx_atoi(value[1].data, value[1].len);
+    if (entries == NGX_ERROR || entries < 1 || entries > CACHE_L1_MAX_ENTRIES)
+    {
+        ngx_log_stderr(0, "Invalid number of L1 entries \"%V\", expecting 1 to %d",
+            &value[1], CACHE_L1_MAX_ENTRIES);
+        return NGX_CONF_ERROR;
+    }
+    mcf->l1_entries = entries;
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief Configuration setup for responses with the document
+ * @param cf Module configuration structure pointer
+ * @param cmd Module directives structure pointer
+ * @param conf Module configuration structure pointer
+ * @returns string Status of the configuration setup
+ */
+static char *ngx_http_couchlookup_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    // Module config, the document can be inherited: checked on merge
+    ngx_http_couchlookup_conf_s *mcf = conf;
+    if (mcf->pass)
+    {
+        ngx_log_stderr(0, "Duplicate couchlookup_pass");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_t *value = cf->args->elts;
+
+    // Handling optional parameter: field, declared by couchlookup_read_doc
+    if (cf->args->nelts == 2)
+        mcf->pass_field = value[1];
+
+    ngx_http_core_loc_conf_t *clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_couchlookup_pass_handler;
+    mcf->pass = 1;
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief Configuration setup for hedged lookups
+ * @param cf Module configuration structure pointer
+ * @param cmd Module directives structure pointer
+ * @param conf Module configuration structure pointer
+ * @returns string Status of the configuration setup
+ */
+static char *ngx_http_couchlookup_hedge_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    // Module config
+    ngx_http_couchlookup_conf_s *mcf = conf;
+    if (mcf->hedge_budget != NGX_CONF_UNSET_UINT)
+    {
+        ngx_log_stderr(0, "Duplicate couchlookup_hedge");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_t *value = cf->args->elts;
+
+    // Handling first parameter: delay, `p95` or `off`
+    if (ngx_strcmp(value[1].data, "off") == 0)
+    {
+        if (cf->args->nelts > 2)
+        {
+            ngx_log_stderr(0, "couchlookup_hedge off takes no other parameter");
+            return NGX_CONF_ERROR;
+        }
+        mcf->hedge_delay = 0;
+        mcf->hedge_budget = 0;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[1].data, "p95") == 0)
+        mcf->hedge_delay = 0;
+    else
+    {
+        mcf->hedge_delay = ngx_parse_time(&value[1], 0);
+        if (mcf->hedge_delay == (ngx_msec_t)NGX_ERROR || mcf->hedge_delay == 0)
+        {
+            ngx_log_stderr(0, "Invalid hedging delay \"%V\", expecting a time or p95", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+    mcf->hedge_budget = HEDGE_BUDGET_DEFAULT;
+
+    // Handling optional second parameter: budget=N%
+    if (cf->args->nelts == 3)
+    {
+        ngx_int_t budget = NGX_ERROR;
+        if (ngx_strncmp(value[2].data, "budget=", 7) == 0 && value[2].len > 8
+            && value[2].data[value[2].len - 1] == '%')
+            budget = ngx_atoi(value[2].data + 7, value[2].len - 8);
+        if (budget == NGX_ERROR || budget < 1 || budget > 100)
+        {
+            ngx_log_stderr(0, "Invalid hedging budget \"%V\", expecting budget=1%% to budget=100%%",
+                &value[2]);
+            return NGX_CONF_ERROR;
+        }
+        mcf->hedge_budget = budget;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief Configuration setup for thread pool lookups
+ * @param cf Module configuration structure pointer
+ * @param cmd Module directives structure pointer
+ * @param conf Module configuration structure pointer
+ * @returns string Status of the configuration setup
+ */
+static char *ngx_http_couchlookup_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_THREADS)
+    // Module config
+    ngx_http_couchlookup_conf_s *mcf = conf;
+
+    ngx_str_t *value = cf->args->elts;
 
-failure:
-    if (fd != NGX_INVALID_FILE && ngx_close_file(fd) == NGX_FILE_ERROR)
-        ngx_log_stderr(0, "Could not close file descriptor for file: %*s",
-            creds_file->len, creds_file->data);
+    // Pool can be declared with `thread_pool` after this directive, checked at init
+    mcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (mcf->thread_pool == NULL)
+        return NGX_CONF_ERROR;
 
-    if (buf != NULL)
-        ngx_free(buf);
+    if (!ngx_http_couchlookup_tls_key_created)
+    {
+        if (pthread_key_create(&ngx_http_couchlookup_tls_key, NULL) != 0)
+        {
+            ngx_log_stderr(0, "Could not create thread-local key for couchbase instances");
+            return NGX_CONF_ERROR;
+        }
+        ngx_http_couchlookup_tls_key_created = 1;
+    }
 
-    return rc;
+    return NGX_CONF_OK;
+#else
+    ngx_log_stderr(0, "couchlookup_thread_pool needs nginx to be built with --with-threads");
+    return NGX_CONF_ERROR;
+#endif
 }
 
 /**
- * @brief Configuration setup for couch key and variables to declare
+ * @brief Configuration setup for batching of thread pool lookups
  * @param cf Module configuration structure pointer
  * @param cmd Module directives structure pointer
  * @param conf Module configuration structure pointer
  * @returns string Status of the configuration setup
  */
-static char *ngx_http_couchlookup_read_doc(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static char *ngx_http_couchlookup_batch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
+#if (NGX_THREADS)
     // Module config
     ngx_http_couchlookup_conf_s *mcf = conf;
-    if (mcf->couch_instance == NULL)
+
+    ngx_str_t *value = cf->args->elts;
+
+    // Handling first parameter: maximum batch size
+    ngx_int_t size = ngx_atoi(value[1].data, value[1].len);
+    if (size == NGX_ERROR || size < 1 || size > BATCH_MAX_SIZE)
     {
-        ngx_log_stderr(0, "Couchbase instance not found. Hint: couchlookup_read_doc needs " \
-            "to be placed after couchlookup_creds.");
+        ngx_log_stderr(0, "Invalid batch size \"%V\", expecting 1 to %d",
+            &value[1], BATCH_MAX_SIZE);
         return NGX_CONF_ERROR;
     }
+    mcf->batch_size = size;
 
-    mcf->complex_couch_key = ngx_palloc(cf->pool, sizeof (ngx_http_complex_value_t));
-    if (mcf->complex_couch_key == NULL)
-        return NGX_CONF_ERROR;
+    // Handling optional second parameter: batch window
+    if (cf->args->nelts == 3)
+    {
+        mcf->batch_window = ngx_parse_time(&value[2], 0);
+        if (mcf->batch_window == (ngx_msec_t)NGX_ERROR)
+        {
+            ngx_log_stderr(0, "Invalid batch window \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+#else
+    ngx_log_stderr(0, "couchlookup_batch needs nginx to be built with --with-threads");
+    return NGX_CONF_ERROR;
+#endif
+}
+
+/**
+ * @brief Configuration setup for per-node limits of thread pool lookups
+ * @param cf Module configuration structure pointer
+ * @param cmd Module directives structure pointer
+ * @param conf Module configuration structure pointer
+ * @returns string Status of the configuration setup
+ */
+static char *ngx_http_couchlookup_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_THREADS)
+    // Module config, the thread pool can be inherited: checked on merge
+    ngx_http_couchlookup_conf_s *mcf = conf;
 
     ngx_str_t *value = cf->args->elts;
 
-    // Handling first parameter: couchbase key
-    if (ngx_http_script_variables_count(&value[1]) != 1)
+    // Handling first parameter: maximum number of in-flight lookups per node
+    ngx_int_t max = ngx_atoi(value[1].data, value[1].len);
+    if (max == NGX_ERROR || max < 1 || max > LIMIT_MAX)
     {
-        ngx_log_stderr(0, "couchlookup_read_doc will only interpret one variable");
+        ngx_log_stderr(0, "Invalid in-flight limit \"%V\", expecting 1 to %d",
+            &value[1], LIMIT_MAX);
         return NGX_CONF_ERROR;
     }
+    mcf->limit_max = max;
+    mcf->limit_latency = LIMIT_LATENCY_DEFAULT;
+    mcf->limit_overflow = CL_OVERFLOW_QUEUE;
 
-    ngx_http_compile_complex_value_t ccv;
-    ngx_memzero(&ccv, sizeof (ngx_http_compile_complex_value_t));
-    ccv.cf = cf;
-    ccv.value = &value[1]; // value[0] is the command name
-    ccv.complex_value = mcf->complex_couch_key;
-
-    if (ngx_http_compile_complex_value(&ccv) != NGX_OK)
-        return NGX_CONF_ERROR;
-
-    // Handling second parameter: variable names
-    char *name_tok = strtok((char *)value[2].data, ",");
-    do
+    // Handling optional parameters: latency=, overflow=
+    ngx_uint_t i;
+    for (i = 2; i < cf->args->nelts; ++i)
     {
-        ngx_str_t *var_name = ngx_palloc(cf->pool, sizeof (ngx_str_t));
-        if (var_name == NULL)
-            return NGX_CONF_ERROR;
-        var_name->len = snprintf(NULL, 0, VAR_NAME_TPL, name_tok);
-        var_name->data = ngx_palloc(cf->pool, sizeof (u_char) * (var_name->len + 1));
-        if (sprintf((char *)var_name->data, VAR_NAME_TPL, name_tok) < 0)
-            return NGX_CONF_ERROR;
-
-        ngx_http_variable_t *var = ngx_http_add_variable(cf, var_name, NGX_HTTP_VAR_CHANGEABLE);
-        if (var == NULL)
-            return NGX_CONF_ERROR;
-        var->get_handler = ngx_http_couchlookup_variable_handler;
-        var->data = (uintptr_t)mcf;
-
-        ngx_http_aqvar_s *aqvar = ngx_palloc(cf->pool, sizeof (ngx_http_aqvar_s));
-        if (aqvar == NULL)
-            return NGX_CONF_ERROR;
-        aqvar->name = var_name;
-        // Calling ngx_http_get_variable_index registers the variable index in request->variables
-        aqvar->index = ngx_http_get_variable_index(cf, var_name);
-        if (ngx_http_hashtb_add(mcf->aqvars, aqvar->name, aqvar) == HTB_ADD_FAILURE)
+        if (ngx_strncmp(value[i].data, "latency=", 8) == 0)
+        {
+            ngx_str_t latency = { .data = value[i].data + 8, .len = value[i].len - 8 };
+            mcf->limit_latency = ngx_parse_time(&latency, 0);
+            if (mcf->limit_latency == (ngx_msec_t)NGX_ERROR || mcf->limit_latency == 0)
+            {
+                ngx_log_stderr(0, "Invalid limit latency \"%V\"", &latency);
+                return NGX_CONF_ERROR;
+            }
+        }
+        else if (ngx_strcmp(value[i].data, "overflow=queue") == 0)
+            mcf->limit_overflow = CL_OVERFLOW_QUEUE;
+        else if (ngx_strcmp(value[i].data, "overflow=reject") == 0)
+            mcf->limit_overflow = CL_OVERFLOW_REJECT;
+        else if (ngx_strcmp(value[i].data, "overflow=stale") == 0)
+            mcf->limit_overflow = CL_OVERFLOW_STALE;
+        else
+        {
+            ngx_log_stderr(0, "Invalid couchlookup_limit parameter \"%V\", expecting " \
+                "latency=TIME or overflow=queue|reject|stale", &value[i]);
             return NGX_CONF_ERROR;
-
-        name_tok = strtok(NULL, ",");
+        }
     }
-    while (name_tok != NULL);
 
     return NGX_CONF_OK;
+#else
+    ngx_log_stderr(0, "couchlookup_limit needs nginx to be built with --with-threads");
+    return NGX_CONF_ERROR;
+#endif
 }
 
+/**
+ * @brief Lookup statistics variables, see ngx_http_couchlookup_stat_variable
+ */
+static ngx_http_variable_t ngx_http_couchlookup_vars[] = {
+    { ngx_string("couchlookup_time"), NULL, ngx_http_couchlookup_stat_variable,
+      CL_STAT_TIME, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("couchlookup_parse_time"), NULL, ngx_http_couchlookup_stat_variable,
+      CL_STAT_PARSE_TIME, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("couchlookup_doc_bytes"), NULL, ngx_http_couchlookup_stat_variable,
+      CL_STAT_DOC_BYTES, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("couchlookup_cache_status"), NULL, ngx_http_couchlookup_stat_variable,
+      CL_STAT_CACHE_STATUS, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("couchlookup_status"), NULL, ngx_http_couchlookup_stat_variable,
+      CL_STAT_STATUS, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("couchlookup_node"), NULL, ngx_http_couchlookup_stat_variable,
+      CL_STAT_NODE, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("couchlookup_ops"), NULL, ngx_http_couchlookup_stat_variable,
+      CL_STAT_OPS, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    ngx_http_null_variable
+};
+
 /**
  * @brief Nginx configuration mappings
  * @details Flags info: http://www.nginxguts.com/2011/09/configuration-directives/
  */
 static ngx_command_t ngx_http_couchlookup_commands[] = {
     { ngx_string("couchlookup_creds"),      // directive name
-      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1, // context and arguments
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1, // context and arguments
       ngx_http_couchlookup_creds,           // configuration setup function
       NGX_HTTP_LOC_CONF_OFFSET,         // offset of the field in the conf data struct
       0,                                // offset when storing the module conf on struct
       NULL },
 
+    { ngx_string("couchlookup_failover"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      ngx_http_couchlookup_failover,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("couchlookup_config_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_couchlookup_config_cache,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("couchlookup_read_doc"),
-      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
       ngx_http_couchlookup_read_doc,
       NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
 
+    { ngx_string("couchlookup_enum"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
+      ngx_http_couchlookup_enum,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("couchlookup_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_couchlookup_cache_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("couchlookup_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_couchlookup_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("couchlookup_cache_l1"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_couchlookup_cache_l1,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("couchlookup_pass"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_couchlookup_pass,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("couchlookup_pass_type"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_couchlookup_conf_s, pass_type),
+      NULL },
+
+    { ngx_string("couchlookup_hedge"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_couchlookup_hedge_conf,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("couchlookup_thread_pool"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_couchlookup_thread_pool,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("couchlookup_batch"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_couchlookup_batch,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("couchlookup_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      ngx_http_couchlookup_limit,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     ngx_null_command // command termination
 };
 
+/**
+ * @brief Registers the lookup statistics variables
+ * @param cf Module configuration structure pointer
+ * @returns NGX_OK on success, NGX_ERROR otherwise
+ */
+static ngx_int_t ngx_http_couchlookup_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t *v;
+    for (v = ngx_http_couchlookup_vars; v->name.len > 0; ++v)
+    {
+        ngx_http_variable_t *var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL)
+            return NGX_ERROR;
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * @brief Allocation/init of the main configuration in memory
+ * @returns Pointer to allocated module main configuration
+ */
+static void *ngx_http_couchlookup_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_couchlookup_main_conf_s *cmcf;
+    if ((cmcf = ngx_pcalloc(cf->pool, sizeof (ngx_http_couchlookup_main_conf_s))) == NULL)
+        return NULL;
+
+    if (ngx_array_init(&cmcf->instances, cf->pool, 4,
+            sizeof (ngx_http_couchlookup_instance_s *)) != NGX_OK
+        || ngx_array_init(&cmcf->zones, cf->pool, 1,
+            sizeof (ngx_http_couchlookup_zone_s)) != NGX_OK)
+        return NULL;
+
+    return cmcf;
+}
+
 /**
  * @brief Allocation/init of the configuration in memory
  * @returns Pointer to allocated module configuration
@@ -309,28 +2800,307 @@ static void *ngx_http_couchlookup_create_loc_conf(ngx_conf_t *cf)
         return NULL;
 
     mcf->complex_couch_key = NULL;
-    mcf->couch_instance = NULL;
+    mcf->clusters = NULL;
+    mcf->failover_failures = NGX_CONF_UNSET_UINT;
+    mcf->failover_latency = NGX_CONF_UNSET_MSEC;
+    mcf->failover_retry = NGX_CONF_UNSET;
+    mcf->enums = NULL;
+    mcf->cache_zone = NULL;
+    mcf->cache_valid = CACHE_VALID_DEFAULT;
+    mcf->l1_entries = NGX_CONF_UNSET_UINT;
+    mcf->l1 = NULL;
+    mcf->pass = 0;
+    ngx_str_null(&mcf->pass_field);
+    mcf->pass_slot = NGX_CONF_UNSET;
+    ngx_str_null(&mcf->pass_type);
+    mcf->hedge_delay = NGX_CONF_UNSET_MSEC;
+    mcf->hedge_budget = NGX_CONF_UNSET_UINT;
+    mcf->hedge = NULL;
+#if (NGX_THREADS)
+    mcf->thread_pool = NULL;
+    mcf->batch_size = NGX_CONF_UNSET_UINT;
+    mcf->batch_window = NGX_CONF_UNSET_MSEC;
+    mcf->batch = NULL;
+    mcf->limit_max = NGX_CONF_UNSET_UINT;
+    mcf->limit_latency = NGX_CONF_UNSET_MSEC;
+    mcf->limit_overflow = NGX_CONF_UNSET_UINT;
+#endif
     if ((mcf->aqvars = ngx_http_hashtb_init(cf->pool, VAR_HTB_SIZE)) == NULL)
         return NULL;
 
     return mcf;
 }
 
+/**
+ * @brief Checks that a cache zone is only used with the same clusters
+ * @details Entries are keyed by couch key alone: locations reading other
+ *  buckets would be served each other's documents.
+ * @param cf Module configuration structure pointer
+ * @param mcf Module configuration of a location using a cache zone
+ * @returns NGX_OK on success, NGX_ERROR otherwise
+ */
+static ngx_int_t ngx_http_couchlookup_check_zone(ngx_conf_t *cf,
+    ngx_http_couchlookup_conf_s *mcf)
+{
+    ngx_http_couchlookup_main_conf_s *cmcf =
+        ngx_http_conf_get_module_main_conf(cf, ngx_http_couchlookup_module);
+
+    ngx_http_couchlookup_zone_s *zone = cmcf->zones.elts;
+    ngx_uint_t i, j;
+    for (i = 0; i < cmcf->zones.nelts; ++i)
+    {
+        if (zone[i].zone != mcf->cache_zone)
+            continue;
+        if (zone[i].clusters == mcf->clusters)
+            return NGX_OK;
+
+        // Creds files listing the same clusters share their instances
+        ngx_http_couchlookup_cluster_s *a = zone[i].clusters->elts, *b = mcf->clusters->elts;
+        ngx_flag_t same = zone[i].clusters->nelts == mcf->clusters->nelts;
+        for (j = 0; same && j < mcf->clusters->nelts; ++j)
+            same = a[j].instance == b[j].instance;
+        if (same)
+            return NGX_OK;
+
+        ngx_log_stderr(0, "Cache zone \"%V\" is used with different couchbase clusters, " \
+            "each set of creds needs a zone of its own", &mcf->cache_zone->shm.name);
+        return NGX_ERROR;
+    }
+
+    if ((zone = ngx_array_push(&cmcf->zones)) == NULL)
+        return NGX_ERROR;
+    zone->zone = mcf->cache_zone;
+    zone->clusters = mcf->clusters;
+
+    return NGX_OK;
+}
+
+/**
+ * @brief Inherits the configuration of the enclosing block
+ * @details Per-worker state (L1 table, pending batch) is created here, for
+ *  each location that looks up documents differently from its parent.
+ * @param cf Module configuration structure pointer
+ * @param parent Module configuration of the enclosing block
+ * @param child Module configuration of the block
+ * @returns string Status of the configuration merge
+ */
+static char *ngx_http_couchlookup_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_couchlookup_conf_s *prev = parent;
+    ngx_http_couchlookup_conf_s *mcf = child;
+
+    if (mcf->clusters == NULL)
+        mcf->clusters = prev->clusters;
+
+    ngx_conf_merge_uint_value(mcf->failover_failures, prev->failover_failures,
+        FAILOVER_FAILURES_DEFAULT);
+    ngx_conf_merge_msec_value(mcf->failover_latency, prev->failover_latency, 0);
+    ngx_conf_merge_value(mcf->failover_retry, prev->failover_retry, FAILOVER_RETRY_DEFAULT);
+
+    if (mcf->complex_couch_key == NULL)
+    {
+        mcf->complex_couch_key = prev->complex_couch_key;
+        mcf->aqvars = prev->aqvars;
+        mcf->nvars = prev->nvars;
+        mcf->enums = prev->enums;
+    }
+
+    if (mcf->cache_zone == NULL)
+    {
+        mcf->cache_zone = prev->cache_zone;
+        mcf->cache_valid = prev->cache_valid;
+    }
+    ngx_conf_merge_uint_value(mcf->l1_entries, prev->l1_entries, 0);
+    ngx_conf_merge_str_value(mcf->pass_type, prev->pass_type, PASS_TYPE_DEFAULT);
+    if (mcf->hedge_budget == NGX_CONF_UNSET_UINT)
+    {
+        mcf->hedge_budget = prev->hedge_budget == NGX_CONF_UNSET_UINT ? 0 : prev->hedge_budget;
+        mcf->hedge_delay = prev->hedge_delay;
+    }
+
+#if (NGX_THREADS)
+    if (mcf->thread_pool == NULL)
+        mcf->thread_pool = prev->thread_pool;
+    ngx_conf_merge_uint_value(mcf->batch_size, prev->batch_size, 0);
+    ngx_conf_merge_msec_value(mcf->batch_window, prev->batch_window, BATCH_WINDOW_DEFAULT);
+    if (mcf->limit_max == NGX_CONF_UNSET_UINT)
+    {
+        mcf->limit_max = prev->limit_max == NGX_CONF_UNSET_UINT ? 0 : prev->limit_max;
+        mcf->limit_latency = prev->limit_latency;
+        mcf->limit_overflow = prev->limit_overflow;
+    }
+#endif
+
+    if (mcf->complex_couch_key == NULL)
+    {
+        if (!mcf->pass)
+            return NGX_CONF_OK;
+
+        ngx_log_stderr(0, "Couch document not found. Hint: couchlookup_pass needs " \
+            "couchlookup_read_doc in the same or an enclosing block.");
+        return NGX_CONF_ERROR;
+    }
+
+    if (mcf->clusters == NULL)
+    {
+        ngx_log_stderr(0, "Couchbase instance not found. Hint: couchlookup_read_doc needs " \
+            "couchlookup_creds in the same or an enclosing block.");
+        return NGX_CONF_ERROR;
+    }
+
+    if (mcf->cache_zone != NULL && ngx_http_couchlookup_check_zone(cf, mcf) != NGX_OK)
+        return NGX_CONF_ERROR;
+
+    // Nested blocks doing the same lookup (e.g. `if`) share the state of their parent
+    ngx_flag_t same = mcf->aqvars == prev->aqvars
+        && mcf->clusters == prev->clusters
+        && mcf->cache_zone == prev->cache_zone
+        && mcf->cache_valid == prev->cache_valid;
+
+    if (mcf->pass_field.len > 0)
+    {
+        // Directive arguments are null-terminated
+        size_t var_len = snprintf(NULL, 0, VAR_NAME_TPL, (char *)mcf->pass_field.data);
+        char buf_varname[var_len + 1];
+        sprintf(buf_varname, VAR_NAME_TPL, (char *)mcf->pass_field.data);
+        ngx_str_t var_name = { .data = (u_char *)buf_varname, .len = var_len };
+
+        ngx_http_aqvar_s *aqvar = ngx_http_hashtb_get(mcf->aqvars, &var_name);
+        if (aqvar == NULL)
+        {
+            ngx_log_stderr(0, "Field \"%V\" of couchlookup_pass needs to be declared " \
+                "by couchlookup_read_doc", &mcf->pass_field);
+            return NGX_CONF_ERROR;
+        }
+        mcf->pass_slot = aqvar->slot;
+    }
+
+    // L1 tables keep variables only, responses need the document
+    if (mcf->pass)
+        mcf->l1 = NULL;
+    else if (same && prev->l1 != NULL && mcf->l1_entries == prev->l1_entries)
+        mcf->l1 = prev->l1;
+    else if (mcf->l1_entries > 0)
+    {
+        if (mcf->cache_zone == NULL)
+        {
+            ngx_log_stderr(0, "Cache zone not found. Hint: couchlookup_cache_l1 needs " \
+                "couchlookup_cache in the same or an enclosing block.");
+            return NGX_CONF_ERROR;
+        }
+
+        // Per worker state: each worker gets its own copy of the configuration
+        if ((mcf->l1 = ngx_http_clcache_l1_create(cf->pool, mcf->l1_entries)) == NULL)
+            return NGX_CONF_ERROR;
+    }
+
+    // Per worker state, shared by the thread pool threads of the worker
+    if (same && prev->hedge != NULL && mcf->hedge_budget == prev->hedge_budget
+        && mcf->hedge_delay == prev->hedge_delay)
+        mcf->hedge = prev->hedge;
+    else if (mcf->hedge_budget > 0
+        && (mcf->hedge = ngx_http_clhedge_create(cf->pool, mcf->hedge_delay,
+            mcf->hedge_budget)) == NULL)
+        return NGX_CONF_ERROR;
+
+#if (NGX_THREADS)
+    if (same && prev->batch != NULL && mcf->thread_pool == prev->thread_pool
+        && mcf->batch_size == prev->batch_size && mcf->batch_window == prev->batch_window)
+        mcf->batch = prev->batch;
+    else if (mcf->batch_size > 0 && mcf->thread_pool != NULL)
+    {
+        if ((mcf->batch = ngx_pcalloc(cf->pool, sizeof (ngx_http_couchlookup_batch_s))) == NULL)
+            return NGX_CONF_ERROR;
+
+        // Per worker state, like the L1 table
+        ngx_queue_init(&mcf->batch->pending);
+        mcf->batch->flush.handler = ngx_http_couchlookup_batch_flush;
+        mcf->batch->flush.data = mcf;
+    }
+
+    if (mcf->limit_max > 0)
+    {
+        if (mcf->thread_pool == NULL)
+        {
+            ngx_log_stderr(0, "Thread pool not found. Hint: couchlookup_limit needs " \
+                "couchlookup_thread_pool in the same or an enclosing block.");
+            return NGX_CONF_ERROR;
+        }
+
+        // Per worker state like the L1 table, but nodes are limited whatever the location
+        ngx_http_couchlookup_main_conf_s *cmcf =
+            ngx_http_conf_get_module_main_conf(cf, ngx_http_couchlookup_module);
+        if (cmcf->limit == NULL && (cmcf->limit = ngx_http_cllimit_create(cf->pool)) == NULL)
+            return NGX_CONF_ERROR;
+    }
+#endif
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief Registers phase handlers once the configuration is read
+ * @param cf Module configuration structure pointer
+ * @returns NGX_OK on success, NGX_ERROR otherwise
+ */
+static ngx_int_t ngx_http_couchlookup_init(ngx_conf_t *cf)
+{
+#if (NGX_THREADS)
+    ngx_http_core_main_conf_t *cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    // Handlers run in reverse order of registration: this one runs before rewrite module's
+    ngx_http_handler_pt *h = ngx_array_push(&cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
+    if (h == NULL)
+        return NGX_ERROR;
+    *h = ngx_http_couchlookup_handler;
+#endif
+
+    return NGX_OK;
+}
+
+/**
+ * @brief Leaves topology files to the master process in the workers
+ * @details Instances are bootstrapped by the master, which writes the files of
+ *  couchlookup_config_cache on startup and reload. Its worker copies only read
+ *  them, as do thread instances: a single writer per file.
+ * @param cycle Cycle of the worker
+ * @returns NGX_OK, failures are only logged
+ */
+static ngx_int_t ngx_http_couchlookup_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_couchlookup_main_conf_s *cmcf =
+        ngx_http_cycle_get_module_main_conf(cycle, ngx_http_couchlookup_module);
+    if (cmcf == NULL || cmcf->config_cache.len == 0)
+        return NGX_OK;
+
+    ngx_http_couchlookup_instance_s **inst = cmcf->instances.elts;
+    ngx_uint_t i;
+    for (i = 0; i < cmcf->instances.nelts; ++i)
+    {
+        if (inst[i]->instance != NULL
+            && lcw_config_cache_ro(inst[i]->instance, inst[i]->creds.config_cache) != 0)
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0, "Could not make topology file "
+                "\"%s\" read only, it is also written by this worker", inst[i]->creds.config_cache);
+    }
+
+    return NGX_OK;
+}
+
 /**
  * @brief Module context and configuration bindings
  */
 static ngx_http_module_t ngx_http_couchlookup_module_ctx = {
-    NULL,                                 // preconfiguration
-    NULL,                                 // postconfiguration
+    ngx_http_couchlookup_add_variables,    // preconfiguration
+    ngx_http_couchlookup_init,             // postconfiguration
 
-    NULL,                                 // create main configuration
-    NULL,                                 // init main configuration
+    ngx_http_couchlookup_create_main_conf, // create main configuration
+    NULL,                                  // init main configuration
 
-    NULL,                                 // create server configuration
-    NULL,                                 // merge server configuration
+    NULL,                                  // create server configuration
+    NULL,                                  // merge server configuration
 
-    ngx_http_couchlookup_create_loc_conf, // create location configuration
-    NULL                                  // merge location configuration
+    ngx_http_couchlookup_create_loc_conf,  // create location configuration
+    ngx_http_couchlookup_merge_loc_conf    // merge location configuration
 };
 
 /**
@@ -343,7 +3113,7 @@ ngx_module_t ngx_http_couchlookup_module = {
     NGX_HTTP_MODULE,                  // module type
     NULL,                             // init master
     NULL,                             // init module
-    NULL,                             // init process
+    ngx_http_couchlookup_init_process, // init process
     NULL,                             // init thread
     NULL,                             // exit thread
     NULL,                             // exit process
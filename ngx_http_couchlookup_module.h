@@ -3,17 +3,27 @@
 
 # include <libcouchbase/couchbase.h>
 # include "ngx_http_hashtb.h"
+# include "ngx_http_clcache.h"
+# include "ngx_http_clcache_l1.h"
+# include "ngx_http_cllimit.h"
+# include "ngx_http_clhedge.h"
+# include "ngx_http_cljson.h"
+# include "ngx_http_libcouch_wrapper.h"
+# include "lib/jsmn.h"
 
 /**
  * @brief Macros to handle credentials file parsing
  */
-# define _CREDS_TOKEN_DELIM (":\n")
+# define _CREDS_TOKEN_DELIM (":\r\n")
+
+// Topology file of a bucket, in the couchlookup_config_cache directory
+# define CONFIG_CACHE_FILE_TPL ("%V/%s@%s.json%Z")
 
 # define _HANDLE_CREDS_TOKEN_ERROR(token)                      \
     if (token == NULL)                                         \
     {                                                          \
         ngx_log_stderr(0, "Could not read key "#token". "      \
-            "Creds syntax: `HOST:BUCKET:USERNAME:PASSWORD`."); \
+            "Creds syntax: `HOST:BUCKET:USERNAME:PASSWORD[:PRIORITY]`."); \
         goto failure;                                          \
     }
 
@@ -27,16 +37,57 @@
     token = strtok(NULL, _CREDS_TOKEN_DELIM); \
     _HANDLE_CREDS_TOKEN_ERROR(token)
 
+/**
+ * @brief Macros related to failover between the clusters of a creds file
+ */
+# define FAILOVER_FAILURES_DEFAULT (3) // consecutive failed lookups
+# define FAILOVER_RETRY_DEFAULT (10) // seconds before a failed over cluster is tried again
+# define FAILOVER_RTT_WEIGHT (8) // round trips are smoothed over about this many lookups
+
 /**
  * @brief Macros related to variables
  */
 # define VAR_NAME_TPL ("cl_%s")
+# define ENUM_VAR_NAME_TPL ("cl_%s_id")
+# define ENUM_MAX_VALUES (255)
 # define VAR_HTB_SIZE (64)
 
+/**
+ * @brief Macros related to the document cache
+ */
+# define CACHE_VALID_DEFAULT (60) // seconds before a cached document is revalidated
+# define CACHE_ZONE_MIN_SIZE (16 * ngx_pagesize)
+# define CACHE_L1_MAX_ENTRIES (65536)
+# define CACHE_HINT_TTL ("_cl_ttl") // document field overriding the cache lifetime
+# define CACHE_HINT_NOCACHE ("_cl_nocache") // document field keeping it out of the cache
+# define CACHE_HINT_TTL_MAX (365 * 24 * 60 * 60) // longest lifetime a document can ask for
+
+/**
+ * @brief Macros related to hedged lookups
+ */
+# define HEDGE_BUDGET_DEFAULT (5) // percent of lookups
+
+/**
+ * @brief Default content type of couchlookup_pass responses
+ */
+# define PASS_TYPE_DEFAULT ("application/json")
+
+/**
+ * @brief Macros related to batching of thread pool lookups
+ */
+# define BATCH_MAX_SIZE (256)
+# define BATCH_WINDOW_DEFAULT (1) // milliseconds
+
+/**
+ * @brief Macros related to per-node limits of thread pool lookups
+ */
+# define LIMIT_MAX (4096)
+# define LIMIT_LATENCY_DEFAULT (50) // milliseconds
+
 /**
  * @brief Macros related to JSON parsing
  */
-# define JSON_MAX_TOKENS (128)
+# define JSON_MIN_TOKENS (128) // initial size of token arenas
 # define JSON_BUF_KEY_SIZE (128)
 
 // JSMN error bindings err -> string literals
@@ -47,7 +98,7 @@
             err_str = "Encountered a bad token, JSON string is corrupted";     \
             break;                                                             \
         case JSMN_ERROR_NOMEM:                                                 \
-            err_str = "Not enough tokens allocated, JSON string is too large"; \
+            err_str = "Could not allocate tokens for JSON string";             \
             break;                                                             \
         case JSMN_ERROR_PART:                                                  \
             err_str = "JSON string is too short, expecting more JSON data";    \
@@ -61,13 +112,86 @@
  */
 ngx_module_t ngx_http_couchlookup_module;
 
+/**
+ * @brief Couchbase cluster, bootstrapped once at configuration time (or by the workers)
+ * @details Shared by all the locations and creds files listing the same
+ *  creds. Its health is tracked per worker, by the worker and its thread pool
+ *  threads: lookups go to the first healthy cluster by priority.
+ */
+typedef struct {
+    lcw_creds_s creds;
+    lcb_t instance; // NULL until bootstrapped, see ngx_http_couchlookup_cluster_instance
+    ngx_atomic_t failures; // consecutive failed lookups
+    ngx_atomic_t retry; // time the cluster is tried again after a failover, 0 if healthy
+    ngx_atomic_t rtt_us; // smoothed round trip of successful lookups
+#if (NGX_THREADS)
+    ngx_http_cllimit_node_s **routes; // node of each vBucket, see ngx_http_couchlookup_route
+    ngx_uint_t nroutes; // number of vBuckets, 0 until the first limited lookup
+#endif
+} ngx_http_couchlookup_instance_s;
+
+/**
+ * @brief Cluster of a creds file, one per line
+ */
+typedef struct {
+    ngx_http_couchlookup_instance_s *instance;
+    ngx_int_t priority; // lowest first, e.g. the cluster of the same zone
+} ngx_http_couchlookup_cluster_s;
+
+/**
+ * @brief Clusters a cache zone is used with, entries are only keyed by couch key
+ */
+typedef struct {
+    ngx_shm_zone_t *zone;
+    ngx_array_t *clusters; // of the first location using the zone
+} ngx_http_couchlookup_zone_s;
+
+/**
+ * @brief Module main configuration
+ */
+typedef struct {
+    ngx_array_t instances; // of ngx_http_couchlookup_instance_s *, one per distinct creds
+    ngx_array_t zones; // of ngx_http_couchlookup_zone_s, one per cache zone in use
+    ngx_str_t config_cache; // directory of topology files, empty when off
+#if (NGX_THREADS)
+    ngx_http_cllimit_s *limit; // per worker, shared by all locations, NULL if unused
+#endif
+} ngx_http_couchlookup_main_conf_s;
+
 /**
  * @brief Module configuration
+ * @details Fields are inherited by nested locations in groups: creds,
+ *  document (key and variables), cache zone, etc.
  */
 typedef struct {
     ngx_http_complex_value_t *complex_couch_key;
-    lcb_t couch_instance;
+    ngx_array_t *clusters; // of ngx_http_couchlookup_cluster_s by priority
+    ngx_uint_t failover_failures;
+    ngx_msec_t failover_latency; // 0 when slow clusters are not failed over
+    time_t failover_retry;
     ngx_http_hashtb_table_s *aqvars;
+    ngx_uint_t nvars; // number of declared variables
+    ngx_array_t *enums; // of ngx_http_couchlookup_enum_s, NULL when no field is mapped
+    ngx_shm_zone_t *cache_zone; // NULL when caching is off
+    time_t cache_valid;
+    ngx_uint_t l1_entries; // 0 when the per-worker table is off
+    ngx_http_clcache_l1_s *l1; // created on merge, one per location
+    ngx_flag_t pass; // responds with the document, not inherited (content handler)
+    ngx_str_t pass_field; // top-level field to respond with, empty for the whole document
+    ngx_int_t pass_slot; // variable slot of `pass_field`, NGX_CONF_UNSET if empty
+    ngx_str_t pass_type; // content type of the response
+    ngx_msec_t hedge_delay; // 0 to derive it from the observed p95
+    ngx_uint_t hedge_budget; // percent of lookups, 0 when hedging is off
+    ngx_http_clhedge_s *hedge; // created on merge, one per location
+#if (NGX_THREADS)
+    ngx_thread_pool_t *thread_pool; // NULL when lookups block the worker
+    ngx_uint_t batch_size; // 0 when lookups are not batched
+    ngx_msec_t batch_window;
+    struct ngx_http_couchlookup_batch_s *batch; // created on merge, one per location
+    ngx_uint_t limit_max; // 0 when in-flight lookups are not limited
+    ngx_msec_t limit_latency;
+    ngx_uint_t limit_overflow; // see ngx_http_couchlookup_overflow_e
+#endif
 } ngx_http_couchlookup_conf_s;
 
 /**
@@ -75,7 +199,169 @@ typedef struct {
  */
 typedef struct {
     ngx_str_t *name;
-    ngx_int_t index;
+    ngx_int_t index; // index in request->variables
+    ngx_uint_t slot; // index in extracted values, in declaration order
 } ngx_http_aqvar_s;
 
+/**
+ * @brief Value map of a field, see couchlookup_enum
+ */
+typedef struct {
+    ngx_uint_t slot; // slot of the mapped field
+    ngx_uint_t id_slot; // slot of its id variable
+    ngx_str_t *values; // expected values, values[i] maps to id i + 1
+    ngx_str_t *ids; // decimal ids, ids[0] is "0" for other or absent values
+    ngx_uint_t nvalues;
+} ngx_http_couchlookup_enum_s;
+
+/**
+ * @brief JSON token arena, grown to fit the largest document parsed so far
+ */
+typedef struct {
+    jsmntok_t *tokens;
+    unsigned size;
+} ngx_http_couchlookup_tokens_s;
+
+/**
+ * @brief Cache status of a lookup, see $couchlookup_cache_status
+ */
+typedef enum {
+    CL_CACHE_BYPASS, // no cache zone
+    CL_CACHE_MISS,
+    CL_CACHE_HIT,
+    CL_CACHE_STALE, // expired entry, revalidated or fetched again
+    CL_CACHE_L1 // served by the per-worker table
+} ngx_http_couchlookup_cache_status_e;
+
+/**
+ * @brief Handling of lookups to a node at its in-flight limit
+ */
+typedef enum {
+    CL_OVERFLOW_QUEUE, // waits for a lookup to the node to complete
+    CL_OVERFLOW_REJECT, // fails with LCB_EBUSY
+    CL_OVERFLOW_STALE // served from the cache zone even if expired, rejected if absent
+} ngx_http_couchlookup_overflow_e;
+
+/**
+ * @brief Lookup statistics exposed by a variable, stored in its `data`
+ */
+typedef enum {
+    CL_STAT_TIME,
+    CL_STAT_PARSE_TIME,
+    CL_STAT_DOC_BYTES,
+    CL_STAT_CACHE_STATUS,
+    CL_STAT_STATUS,
+    CL_STAT_NODE,
+    CL_STAT_OPS
+} ngx_http_couchlookup_stat_e;
+
+/**
+ * @brief Timings and statuses of a lookup, see $couchlookup_* variables
+ */
+typedef struct {
+    uint64_t time_us; // couchbase round trips
+    uint64_t parse_us;
+    size_t doc_bytes;
+    ngx_uint_t ops; // couchbase operations issued, hedged replica reads included
+    ngx_http_couchlookup_cache_status_e cache_status;
+    lcb_error_t status; // of the last round trip
+    ngx_str_t node; // of the last round trip
+    ngx_http_couchlookup_instance_s *cluster; // of the last round trip, NULL if none
+} ngx_http_couchlookup_stats_s;
+
+/**
+ * @brief Request context, set when the lookup runs in the thread pool
+ */
+typedef struct {
+    ngx_str_t couch_key;
+    unsigned done:1; // result memoized, see ngx_http_couchlookup_memo_s
+    unsigned in_worker:1; // could not be offloaded, looked up by the variable handler
+} ngx_http_couchlookup_ctx_s;
+
+/**
+ * @brief Lookup memoized for a whole request tree (subrequests, redirects)
+ */
+typedef struct ngx_http_couchlookup_memo_s {
+    ngx_str_t couch_key;
+    ngx_http_couchlookup_instance_s *cluster; // answered the lookup, else the location's preferred one
+    lcw_get_result_s *couch_doc; // can be unsuccessful, failures are memoized too
+    ngx_http_couchlookup_conf_s *mcf; // location `values` were extracted for
+    ngx_str_t *values; // indexed by variable slot, NULL if the lookup failed
+    ngx_http_couchlookup_stats_s stats;
+    struct ngx_http_couchlookup_memo_s *next;
+} ngx_http_couchlookup_memo_s;
+
+/**
+ * @brief Document fetch, see ngx_http_couchlookup_fetch
+ */
+typedef struct {
+    ngx_pool_t *pool; // allocation pool for the document
+    ngx_str_t *couch_key;
+    lcw_get_result_s *couch_doc; // NULL on allocation failure
+    ngx_atomic_uint_t generation; // generation of the key in the cache zone
+    time_t expire; // time the document needs revalidation
+    unsigned fresh:1; // read from couchbase, stored once parsed (ngx_http_couchlookup_store)
+    ngx_http_couchlookup_stats_s stats; // `parse_us` is left to the caller
+} ngx_http_couchlookup_fetch_s;
+
+# if (NGX_THREADS)
+/**
+ * @brief Thread pool task context
+ */
+typedef struct {
+    ngx_http_couchlookup_conf_s *mcf;
+    ngx_http_request_t *request;
+    ngx_http_couchlookup_ctx_s *ctx;
+    ngx_pool_t *pool; // owned by the thread until completion
+    lcw_get_result_s *couch_doc; // set by the thread
+    ngx_str_t *values; // set by the thread on success
+    ngx_atomic_uint_t generation; // set by the thread, see ngx_http_couchlookup_fetch_s
+    time_t expire; // set by the thread
+    ngx_http_couchlookup_stats_s stats; // set by the thread
+    ngx_queue_t queue; // link in the pending batch, or in the waiting lookups of `node`
+    ngx_thread_task_t *task; // NULL when batched
+    ngx_http_cllimit_node_s *node; // in-flight limit held by the lookup, NULL if none
+    ngx_http_couchlookup_instance_s *cluster; // the limit was taken for, see ngx_http_couchlookup_route
+    ngx_int_t vbucket; // of the key in `cluster`, -1 if unknown
+    ngx_event_t resume; // posted to look up in the worker, see ngx_http_couchlookup_release
+} ngx_http_couchlookup_task_s;
+
+/**
+ * @brief Pending lookups of a location, per worker
+ */
+typedef struct ngx_http_couchlookup_batch_s {
+    ngx_queue_t pending;
+    ngx_uint_t npending;
+    ngx_event_t flush; // timer for the batch window, posted when the batch is full
+} ngx_http_couchlookup_batch_s;
+
+/**
+ * @brief Thread pool task context of a batch
+ */
+typedef struct {
+    ngx_http_couchlookup_conf_s *mcf;
+    ngx_pool_t *pool; // destroyed on completion
+    ngx_http_couchlookup_task_s **tasks;
+    ngx_uint_t ntasks;
+} ngx_http_couchlookup_batch_task_s;
+
+# endif
+
+/**
+ * @brief Couchbase instance of a thread, one per distinct creds
+ */
+typedef struct ngx_http_couchlookup_tls_instance_s {
+    ngx_http_couchlookup_instance_s *owner; // cluster, as in the event loop
+    lcb_t instance;
+    struct ngx_http_couchlookup_tls_instance_s *next;
+} ngx_http_couchlookup_tls_instance_s;
+
+/**
+ * @brief State of a thread pool thread
+ */
+typedef struct {
+    ngx_http_couchlookup_tls_instance_s *instances;
+    ngx_http_couchlookup_tokens_s tokens;
+} ngx_http_couchlookup_thread_s;
+
 #endif // !NGX_HTTP_COUCHLOOKUP_MODULE_H
@@ -0,0 +1,29 @@
+#ifndef NGX_HTTP_COUCHLOOKUP_PROBES_H
+# define NGX_HTTP_COUCHLOOKUP_PROBES_H
+
+/**
+ * @brief Static tracepoints (USDT) of the `couchlookup` provider
+ * @details Only compiled in when sys/sdt.h was found at configure time with
+ *  COUCHLOOKUP_USDT=yes (see config), no-ops otherwise. Probes:
+ *  - lookup__start(key, key_len)
+ *  - cache__hit(key, key_len, doc_len, cache_status)
+ *  - cache__miss(key, key_len, cache_status)
+ *  - request__issued(key, key_len, meta_only)
+ *  - hedge__issued(key, key_len)
+ *  - response__received(key, key_len, doc_len, status)
+ *  - parse__start(key, key_len, doc_len)
+ *  - parse__end(key, key_len, doc_len, rc)
+ *  - fill__done(key, key_len, found)
+ */
+# if (NGX_HTTP_COUCHLOOKUP_USDT)
+#  include <sys/sdt.h>
+#  define CL_PROBE2(name, a1, a2) DTRACE_PROBE2(couchlookup, name, a1, a2)
+#  define CL_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(couchlookup, name, a1, a2, a3)
+#  define CL_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(couchlookup, name, a1, a2, a3, a4)
+# else
+#  define CL_PROBE2(name, a1, a2) do { } while (0)
+#  define CL_PROBE3(name, a1, a2, a3) do { } while (0)
+#  define CL_PROBE4(name, a1, a2, a3, a4) do { } while (0)
+# endif
+
+#endif // !NGX_HTTP_COUCHLOOKUP_PROBES_H
@@ -1,27 +1,171 @@
 #include <libcouchbase/couchbase.h>
+#include <libcouchbase/vbucket.h>
 #include "ngx_http_libcouch_wrapper.h"
+#include "ngx_http_couchlookup_probes.h"
+
+/**
+ * Operations of a batch, see lcw_get_multi
+ */
+typedef struct {
+    lcb_t instance;
+    lcw_get_op_s *ops;
+    struct lcw_cookie_s **cookies;
+    size_t n;
+    size_t remaining; // scheduled operations without final result
+    uint64_t start;
+    const lcw_hedge_s *hedge; // NULL if unused
+    lcb_timer_t timer; // hedging timer, NULL once fired or if unused
+} lcw_batch_s;
+
+/**
+ * Cookie of the commands of an operation
+ * Hedged cookies are allocated: the losing command answers after the batch returned.
+ */
+typedef struct lcw_cookie_s {
+    lcw_get_result_s *result; // NULL once the batch returned, late answers are dropped
+    lcw_batch_s *batch;
+    unsigned inflight; // commands in flight, two once hedged
+    unsigned done:1; // result is final
+    unsigned allocated:1;
+} lcw_cookie_s;
+
+static lcw_get_result_s *lcw_cookie_answer(lcw_cookie_s *cookie, lcb_error_t rc, ngx_flag_t replica)
+{
+    cookie->inflight--;
+    if (cookie->result == NULL)
+    {
+        if (cookie->inflight == 0)
+            ngx_free(cookie);
+        return NULL;
+    }
+    if (cookie->done)
+        return NULL;
+
+    // Errors are not final while the other copy can answer, except missing keys on the active one
+    if (cookie->inflight > 0 && rc != LCB_SUCCESS && (replica || rc != LCB_KEY_ENOENT))
+        return NULL;
+
+    return cookie->result;
+}
+
+static void lcw_cookie_done(lcw_cookie_s *cookie)
+{
+    lcw_batch_s *batch = cookie->batch;
+    cookie->done = 1;
+    cookie->result->time_us = lcw_clock_us() - batch->start;
+    if (--batch->remaining > 0)
+        return;
+
+    // All answered, not waiting for the hedging timer nor losing commands
+    if (batch->timer != NULL)
+    {
+        lcb_timer_destroy(batch->instance, batch->timer);
+        batch->timer = NULL;
+    }
+    lcb_breakout(batch->instance);
+}
 
 static void lcw_get_handler(lcb_t instance, int cbtype, const lcb_RESPBASE *rb)
 {
-    lcw_get_result_s *get_res = rb->cookie;
+    const lcb_RESPGET *resp = (const lcb_RESPGET*)rb;
+    CL_PROBE4(response__received, rb->key, rb->nkey,
+        rb->rc == LCB_SUCCESS ? resp->nvalue : 0, rb->rc);
+
+    lcw_get_result_s *get_res = lcw_cookie_answer(rb->cookie, rb->rc,
+        cbtype == LCB_CALLBACK_GETREPLICA);
+    if (get_res == NULL)
+        return;
+
     get_res->status = rb->rc;
+    get_res->cas = rb->cas;
+    get_res->replica = cbtype == LCB_CALLBACK_GETREPLICA;
     if (get_res->status == LCB_SUCCESS)
     {
-        const lcb_RESPGET *resp = (const lcb_RESPGET*)rb;
         get_res->len = resp->nvalue;
         get_res->data = ngx_pcalloc(get_res->pool, get_res->len);
         ngx_memcpy(get_res->data, resp->value, resp->nvalue);
     }
+
+    lcw_cookie_done(rb->cookie);
 }
 
-lcb_t lcw_init(ngx_pool_t *pool, const lcw_creds_s *creds)
+static void lcw_get_cas_handler(lcb_t instance, int cbtype, const lcb_RESPBASE *rb)
+{
+    CL_PROBE4(response__received, rb->key, rb->nkey, 0, rb->rc);
+
+    lcw_get_result_s *get_res = lcw_cookie_answer(rb->cookie, rb->rc, 0);
+    if (get_res == NULL)
+        return;
+
+    get_res->status = rb->rc;
+    get_res->cas = rb->cas;
+
+    lcw_cookie_done(rb->cookie);
+}
+
+static void lcw_hedge_handler(lcb_timer_t timer, lcb_t instance, const void *cookie)
+{
+    lcw_batch_s *batch = (lcw_batch_s *)cookie;
+    batch->timer = NULL; // not periodic, destroyed once fired
+
+    lcb_sched_enter(instance);
+    size_t i;
+    for (i = 0; i < batch->n; ++i)
+    {
+        lcw_cookie_s *c = batch->cookies[i];
+        if (c == NULL || !c->allocated || c->done)
+            continue;
+
+        // Reserved when issued, operations answered in time cost no budget
+        if (batch->hedge->reserve != NULL && !batch->hedge->reserve(batch->hedge->data))
+            break;
+
+        ngx_str_t *couch_key = batch->ops[i].couch_key;
+        lcb_CMDGETREPLICA rcmd;
+        ngx_memzero(&rcmd, sizeof (rcmd));
+        LCB_CMD_SET_KEY(&rcmd, couch_key->data, couch_key->len);
+        rcmd.strategy = LCB_REPLICA_FIRST;
+        if (lcb_rget3(instance, c, &rcmd) != LCB_SUCCESS) // e.g. no replica
+        {
+            if (batch->hedge->release != NULL)
+                batch->hedge->release(batch->hedge->data);
+            continue;
+        }
+
+        c->inflight++;
+        c->result->hedged = 1;
+        CL_PROBE2(hedge__issued, couch_key->data, couch_key->len);
+    }
+    lcb_sched_leave(instance);
+}
+
+uint64_t lcw_clock_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+lcb_t lcw_init(const lcw_creds_s *creds)
 {
     lcb_t instance = NULL;
 
-    size_t connstr_len = 1 + snprintf(NULL, 0, LCW_COUCH_CONN_STR, creds->host, creds->bucket);
-    char *connstr = ngx_palloc(pool, sizeof (char) * connstr_len);
-    if (connstr == NULL ||
-        sprintf(connstr, LCW_COUCH_CONN_STR, creds->host, creds->bucket) < 0)
+    // On the stack, this can be called from thread pool threads (no shared pool)
+    const char *fmt = creds->config_cache == NULL ? LCW_COUCH_CONN_STR
+        : creds->config_cache_ro ? LCW_COUCH_CONN_STR_CACHED_RO : LCW_COUCH_CONN_STR_CACHED;
+
+    // Percent-encoded, `&`, `?` or `%` in the path would end the option
+    size_t path_len = creds->config_cache == NULL ? 0 : strlen(creds->config_cache);
+    char path[path_len + 2 * ngx_escape_uri(NULL, (u_char *)creds->config_cache, path_len,
+        NGX_ESCAPE_ARGS) + 1];
+    u_char *end = (u_char *)ngx_escape_uri((u_char *)path, (u_char *)creds->config_cache,
+        path_len, NGX_ESCAPE_ARGS);
+    *end = '\0';
+
+    size_t connstr_len = 1 + snprintf(NULL, 0, fmt, creds->host, creds->bucket, path);
+    char connstr[connstr_len];
+    if (sprintf(connstr, fmt, creds->host, creds->bucket, path) < 0)
         goto failure;
 
     struct lcb_create_st cropts = {
@@ -53,31 +197,179 @@ lcb_t lcw_init(ngx_pool_t *pool, const lcw_creds_s *creds)
     }
 
     lcb_install_callback3(instance, LCB_CALLBACK_GET, lcw_get_handler);
+    lcb_install_callback3(instance, LCB_CALLBACK_GETREPLICA, lcw_get_handler);
+    lcb_install_callback3(instance, LCB_CALLBACK_SDLOOKUP, lcw_get_cas_handler);
 
 failure:
-    if (connstr != NULL)
-        ngx_pfree(pool, connstr);
-
     return instance;
 }
 
-lcw_get_result_s *lcw_get(ngx_pool_t *pool, lcb_t instance, ngx_str_t *couch_key)
+static lcw_get_result_s *lcw_get_result_create(ngx_pool_t *pool)
 {
     lcw_get_result_s *get_res = ngx_palloc(pool, sizeof (lcw_get_result_s));
     if (get_res == NULL)
         return NULL;
 
     get_res->data = NULL;
+    get_res->len = 0;
+    get_res->cas = 0;
+    get_res->status = LCB_SUCCESS;
     get_res->pool = pool;
+    get_res->time_us = 0;
+    ngx_str_null(&get_res->node);
+    get_res->hedged = 0;
+    get_res->replica = 0;
+
+    return get_res;
+}
 
+static lcb_error_t lcw_schedule_get(lcb_t instance, lcw_cookie_s *cookie, ngx_str_t *couch_key)
+{
     lcb_CMDGET gcmd;
     ngx_memzero(&gcmd, sizeof (gcmd));
-
     LCB_CMD_SET_KEY(&gcmd, couch_key->data, couch_key->len);
-    lcb_get3(instance, get_res, &gcmd);
-    lcb_wait(instance);
 
-    return get_res;
+    return lcb_get3(instance, cookie, &gcmd);
+}
+
+static lcb_error_t lcw_schedule_get_cas(lcb_t instance, lcw_cookie_s *cookie, ngx_str_t *couch_key)
+{
+    lcb_SDSPEC spec;
+    ngx_memzero(&spec, sizeof (spec));
+    spec.sdcmd = LCB_SDCMD_GET;
+    spec.options = LCB_SDSPEC_F_XATTRPATH;
+    LCB_SDSPEC_SET_PATH(&spec, LCW_CAS_XATTR_PATH, sizeof (LCW_CAS_XATTR_PATH) - 1);
+
+    lcb_CMDSUBDOC scmd;
+    ngx_memzero(&scmd, sizeof (scmd));
+    LCB_CMD_SET_KEY(&scmd, couch_key->data, couch_key->len);
+    scmd.specs = &spec;
+    scmd.nspecs = 1;
+
+    return lcb_subdoc3(instance, cookie, &scmd);
+}
+
+static void lcw_get_result_set_node(lcb_t instance, lcw_get_result_s *get_res, ngx_str_t *couch_key)
+{
+    // Copied, the string belongs to the current cluster map
+    const char *node = lcw_get_node(instance, couch_key);
+    if (node == NULL)
+        return;
+
+    size_t len = ngx_strlen(node);
+    if ((get_res->node.data = ngx_pnalloc(get_res->pool, len)) == NULL)
+        return;
+    ngx_memcpy(get_res->node.data, node, len);
+    get_res->node.len = len;
+}
+
+void lcw_get_multi(lcb_t instance, lcw_get_op_s *ops, size_t n, const lcw_hedge_s *hedge)
+{
+    lcw_cookie_s cookies[n];
+    lcw_cookie_s *cookie_ptrs[n];
+    lcw_batch_s batch = { .instance = instance, .ops = ops, .cookies = cookie_ptrs, .n = n,
+        .remaining = 0, .start = lcw_clock_us(), .hedge = hedge, .timer = NULL };
+    ngx_flag_t hedging = 0;
+    size_t i;
+
+    // Commands are only flushed on lcb_sched_leave, packets to the same node get coalesced
+    lcb_sched_enter(instance);
+    for (i = 0; i < n; ++i)
+    {
+        lcw_get_op_s *op = &ops[i];
+        cookie_ptrs[i] = NULL;
+        if ((op->result = lcw_get_result_create(op->pool)) == NULL)
+            continue;
+        lcw_get_result_set_node(instance, op->result, op->couch_key);
+
+        // Hedged cookies outlive the batch, falling back to the stack without hedging
+        lcw_cookie_s *c = NULL;
+        if (hedge != NULL && op->hedge && !op->meta_only)
+            c = ngx_alloc(sizeof (lcw_cookie_s), ngx_cycle->log);
+        c = c != NULL ? c : &cookies[i];
+        c->result = op->result;
+        c->batch = &batch;
+        c->inflight = 0;
+        c->done = 0;
+        c->allocated = c != &cookies[i];
+        cookie_ptrs[i] = c;
+
+        op->result->status = op->meta_only
+            ? lcw_schedule_get_cas(instance, c, op->couch_key)
+            : lcw_schedule_get(instance, c, op->couch_key);
+        if (op->result->status == LCB_SUCCESS)
+        {
+            c->inflight = 1;
+            batch.remaining++;
+            hedging |= c->allocated;
+        }
+
+        CL_PROBE3(request__issued, op->couch_key->data, op->couch_key->len, op->meta_only);
+    }
+    lcb_sched_leave(instance);
+
+    if (batch.remaining > 0)
+    {
+        lcb_error_t err;
+        if (hedging)
+            batch.timer = lcb_timer_create(instance, &batch, hedge->delay_us, 0, lcw_hedge_handler, &err);
+
+        lcb_wait(instance);
+
+        if (batch.timer != NULL)
+            lcb_timer_destroy(instance, batch.timer);
+    }
+
+    for (i = 0; i < n; ++i)
+    {
+        lcw_cookie_s *c = cookie_ptrs[i];
+        if (c == NULL || !c->allocated)
+            continue;
+
+        // Losing command still in flight, the cookie is freed by its answer
+        if (c->inflight > 0)
+            c->result = NULL;
+        else
+            ngx_free(c);
+    }
+}
+
+const char *lcw_get_node(lcb_t instance, ngx_str_t *couch_key)
+{
+    return instance == NULL ? NULL : lcb_get_keynode(instance, couch_key->data, couch_key->len);
+}
+
+int lcw_get_vbucket(lcb_t instance, ngx_str_t *couch_key, unsigned *nvbuckets)
+{
+    lcbvb_CONFIG *vbc = NULL;
+    if (instance == NULL || lcb_cntl(instance, LCB_CNTL_GET, LCB_CNTL_VBCONFIG, &vbc) != LCB_SUCCESS || vbc == NULL
+        || LCBVB_NVBUCKETS(vbc) <= 0)
+        return -1;
+
+    *nvbuckets = LCBVB_NVBUCKETS(vbc);
+    return lcbvb_k2vb(vbc, couch_key->data, couch_key->len);
+}
+
+int lcw_config_cache_ro(lcb_t instance, const char *config_cache)
+{
+    return lcb_cntl(instance, LCB_CNTL_SET, LCB_CNTL_CONFIGCACHE_RO, (void *)config_cache)
+        == LCB_SUCCESS ? 0 : -1;
+}
+
+lcw_get_result_s *lcw_get(ngx_pool_t *pool, lcb_t instance, ngx_str_t *couch_key)
+{
+    lcw_get_op_s op = { .pool = pool, .couch_key = couch_key, .meta_only = 0 };
+    lcw_get_multi(instance, &op, 1, NULL);
+
+    return op.result;
+}
+
+lcw_get_result_s *lcw_get_cas(ngx_pool_t *pool, lcb_t instance, ngx_str_t *couch_key)
+{
+    lcw_get_op_s op = { .pool = pool, .couch_key = couch_key, .meta_only = 1 };
+    lcw_get_multi(instance, &op, 1, NULL);
+
+    return op.result;
 }
 
 void lcw_get_result_destroy(lcw_get_result_s *get_res)
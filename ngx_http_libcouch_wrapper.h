@@ -11,6 +11,29 @@
  */
 # define LCW_COUCH_CONN_STR ("couchbase://%s/%s")
 
+/**
+ * @brief Connection string with a persisted cluster topology
+ * @details The instance bootstraps from the file when present, and writes
+ *  the topology it fetched to it. Workers stop writing it, see
+ *  lcw_config_cache_ro: the master process updates it on startup and reload.
+ * @param %s [1] host
+ * @param %s [2] bucket
+ * @param %s [3] topology file, percent-encoded
+ */
+# define LCW_COUCH_CONN_STR_CACHED ("couchbase://%s/%s?config_cache=%s")
+
+/**
+ * @brief Connection string with a persisted cluster topology, never written
+ * @details Same as LCW_COUCH_CONN_STR_CACHED, the master process writes the file.
+ */
+# define LCW_COUCH_CONN_STR_CACHED_RO ("couchbase://%s/%s?config_cache_ro=%s")
+
+/**
+ * @brief Virtual extended attribute holding the document CAS
+ * @details Sub-document lookup of this path returns the CAS without the body.
+ */
+# define LCW_CAS_XATTR_PATH ("$document.CAS")
+
 /**
  * @brief Couchbase credentials, host and bucket
  */
@@ -19,6 +42,8 @@ typedef struct {
     char *bucket;
     char *username;
     char *password;
+    char *config_cache; // topology file, NULL to always bootstrap from the cluster
+    int config_cache_ro; // only read the topology file, another instance writes it
 } lcw_creds_s;
 
 /**
@@ -29,20 +54,89 @@ typedef struct {
 typedef struct {
     u_char *data; // document contents
     size_t len; // document size
+    uint64_t cas; // document revision
     lcb_error_t status; // couchbase operation status
     ngx_pool_t *pool; // nginx allocation pool
+    uint64_t time_us; // round trip until the result, monotonic clock
+    ngx_str_t node; // `host:port` of the node the key maps to, empty if unknown
+    unsigned hedged:1; // also requested from a replica, see lcw_get_multi
+    unsigned replica:1; // answered by a replica
 } lcw_get_result_s;
 
+/**
+ * @brief Operation of a batch, see lcw_get_multi
+ */
+typedef struct {
+    ngx_pool_t *pool; // allocation pool for the result
+    ngx_str_t *couch_key;
+    unsigned meta_only:1; // only retrieve the CAS, see lcw_get_cas
+    unsigned hedge:1; // can be requested from a replica too, ignored with meta_only
+    lcw_get_result_s *result; // set by lcw_get_multi, NULL on allocation failure
+} lcw_get_op_s;
+
+/**
+ * @brief Hedging of a batch, see lcw_get_multi
+ */
+typedef struct {
+    uint32_t delay_us; // operations still in flight after it are hedged
+    ngx_flag_t (*reserve)(void *data); // called before each hedged request, skipped on 0
+    void (*release)(void *data); // called when a reserved request could not be sent
+    void *data; // passed to `reserve` and `release`
+} lcw_hedge_s;
+
+/**
+ * @brief Monotonic clock, in microseconds
+ */
+uint64_t lcw_clock_us(void);
+
 /**
  * @brief Creates new couchbase instance
  */
-lcb_t lcw_init(ngx_pool_t *pool, const lcw_creds_s *creds);
+lcb_t lcw_init(const lcw_creds_s *creds);
+
+/**
+ * @brief Returns the node a key maps to in the current cluster map
+ * @returns `host:port` of the node, NULL if unknown (or no instance)
+ */
+const char *lcw_get_node(lcb_t instance, ngx_str_t *couch_key);
+
+/**
+ * @brief Returns the vBucket a key maps to
+ * @details Only depends on the number of vBuckets of the bucket: keys map to
+ *  the right vBucket even with an outdated cluster map.
+ * @param nvbuckets Set to the number of vBuckets of the bucket
+ * @returns vBucket, -1 if unknown (no instance or cluster map yet, memcached bucket)
+ */
+int lcw_get_vbucket(lcb_t instance, ngx_str_t *couch_key, unsigned *nvbuckets);
+
+/**
+ * @brief Stops a bootstrapped instance from writing its topology file
+ * @details The instance keeps reading it, e.g. a worker copy of an instance
+ *  bootstrapped by the master process, which wrote the file.
+ * @returns 0 on success, -1 on failure
+ */
+int lcw_config_cache_ro(lcb_t instance, const char *config_cache);
 
 /**
  * @brief GET call to retrieve a couchbase document
  */
 lcw_get_result_s *lcw_get(ngx_pool_t *pool, lcb_t instance, ngx_str_t *couch_key);
 
+/**
+ * @brief Metadata-only call to retrieve the CAS of a couchbase document
+ * @details The returned result has no `data`, only `status` and `cas`.
+ */
+lcw_get_result_s *lcw_get_cas(ngx_pool_t *pool, lcb_t instance, ngx_str_t *couch_key);
+
+/**
+ * @brief Batch of GET calls, scheduled together and waited on once
+ * @details Operations flagged `hedge` and still in flight after the hedging
+ *  delay (`hedge` NULL to never hedge) are requested from a replica too, as
+ *  long as `reserve` allows it. The first answer wins, the batch returns
+ *  without waiting for the other one.
+ */
+void lcw_get_multi(lcb_t instance, lcw_get_op_s *ops, size_t n, const lcw_hedge_s *hedge);
+
 /**
  * @brief Deallocates a couchbase GET result
  */
@@ -0,0 +1,81 @@
+/*
+ * Stand-ins for the few nginx functions and globals used by the tested
+ * units, so that they link without the rest of nginx. Pools are plain
+ * malloc: tests pass NULL pools and never free them.
+ */
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+volatile ngx_msec_t ngx_current_msec;
+
+static ngx_time_t t_cached_time = { .sec = 1000000 };
+volatile ngx_time_t *ngx_cached_time = &t_cached_time;
+
+// Nibble table of ngx_crc32_short, filled before main()
+static uint32_t t_crc32_table16[16];
+uint32_t *ngx_crc32_table_short = t_crc32_table16;
+
+static void __attribute__((constructor)) t_crc32_init(void)
+{
+    uint32_t i, c, b;
+    for (i = 0; i < 16; ++i)
+    {
+        for (c = i, b = 0; b < 4; ++b)
+            c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+        t_crc32_table16[i] = c;
+    }
+}
+
+void *ngx_alloc(size_t size, ngx_log_t *log)
+{
+    return malloc(size);
+}
+
+void *ngx_calloc(size_t size, ngx_log_t *log)
+{
+    return calloc(1, size);
+}
+
+void *ngx_palloc(ngx_pool_t *pool, size_t size)
+{
+    return malloc(size);
+}
+
+void *ngx_pnalloc(ngx_pool_t *pool, size_t size)
+{
+    return malloc(size);
+}
+
+void *ngx_pcalloc(ngx_pool_t *pool, size_t size)
+{
+    return calloc(1, size);
+}
+
+ngx_int_t ngx_memn2cmp(u_char *s1, u_char *s2, size_t n1, size_t n2)
+{
+    int rc = memcmp(s1, s2, ngx_min(n1, n2));
+    if (rc != 0)
+        return rc;
+
+    return n1 == n2 ? 0 : (n1 < n2 ? -1 : 1);
+}
+
+ngx_int_t ngx_hextoi(u_char *line, size_t n)
+{
+    ngx_int_t value = 0;
+    if (n == 0)
+        return NGX_ERROR;
+
+    for ( /* void */ ; n--; line++)
+    {
+        u_char c = *line;
+        if (c >= '0' && c <= '9')
+            value = value * 16 + (c - '0');
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            value = value * 16 + ((c | 0x20) - 'a' + 10);
+        else
+            return NGX_ERROR;
+    }
+
+    return value;
+}
@@ -0,0 +1,37 @@
+#ifndef T_H
+# define T_H
+
+# include <stdio.h>
+# include <string.h>
+
+/**
+ * @brief Minimal assertions of the unit tests, failures are counted and reported
+ */
+static int t_failures = 0;
+
+# define T_OK(cond)                                                        \
+    if (!(cond))                                                           \
+    {                                                                      \
+        fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); \
+        t_failures++;                                                      \
+    }
+
+// Compares an ngx_str_t with a C string
+# define T_STR(value, expected)                                            \
+    if ((value).len != strlen(expected)                                    \
+        || memcmp((value).data, expected, (value).len) != 0)               \
+    {                                                                      \
+        fprintf(stderr, "%s:%d: got \"%.*s\", expecting \"%s\"\n",         \
+            __FILE__, __LINE__, (int)(value).len, (value).data, expected); \
+        t_failures++;                                                      \
+    }
+
+# define T_DONE()                                                          \
+    do                                                                     \
+    {                                                                      \
+        fprintf(stderr, "%s: %s\n", __FILE__, t_failures ? "FAILED" : "ok"); \
+        return t_failures > 0;                                             \
+    }                                                                      \
+    while (0)
+
+#endif // !T_H
@@ -0,0 +1,107 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_http_clcache_l1.h"
+#include "t.h"
+
+#define NVALUES (3)
+
+static ngx_str_t key(const char *s)
+{
+    ngx_str_t k = { .data = (u_char *)s, .len = strlen(s) };
+    return k;
+}
+
+static void put(ngx_http_clcache_l1_s *l1, const char *k, const char *url,
+    ngx_atomic_uint_t generation, time_t expire)
+{
+    ngx_str_t kk = key(k);
+    ngx_str_t values[NVALUES] = { ngx_string("redirect"), ngx_null_string, key(url) };
+    ngx_http_clcache_l1_put(l1, NULL, &kk, values, NVALUES, generation, expire);
+}
+
+static ngx_str_t *get(ngx_http_clcache_l1_s *l1, const char *k, ngx_atomic_uint_t generation)
+{
+    ngx_str_t kk = key(k);
+    ngx_uint_t hits;
+    return ngx_http_clcache_l1_get(l1, NULL, &kk, NVALUES, generation, &hits);
+}
+
+static void test_get(void)
+{
+    ngx_http_clcache_l1_s *l1 = ngx_http_clcache_l1_create(NULL, 64);
+    T_OK(get(l1, "doc_1", 1) == NULL);
+
+    put(l1, "doc_1", "https://example.com/1", 1, ngx_time() + 60);
+    ngx_str_t *values = get(l1, "doc_1", 1);
+    T_OK(values != NULL);
+    if (values != NULL)
+    {
+        T_STR(values[0], "redirect");
+        T_OK(values[1].data == NULL);
+        T_STR(values[2], "https://example.com/1");
+    }
+    T_OK(get(l1, "doc_2", 1) == NULL);
+    T_OK(get(l1, "doc_", 1) == NULL);
+
+    // Replaced in place
+    put(l1, "doc_1", "https://example.com/one", 1, ngx_time() + 60);
+    values = get(l1, "doc_1", 1);
+    T_OK(values != NULL);
+    if (values != NULL)
+        T_STR(values[2], "https://example.com/one");
+
+    // Changed in the shared zone: dropped for good
+    T_OK(get(l1, "doc_1", 2) == NULL);
+    T_OK(get(l1, "doc_1", 1) == NULL);
+
+    // Expired
+    put(l1, "doc_3", "https://example.com/3", 1, ngx_time());
+    T_OK(get(l1, "doc_3", 1) == NULL);
+}
+
+static void test_hits(void)
+{
+    ngx_http_clcache_l1_s *l1 = ngx_http_clcache_l1_create(NULL, 64);
+    put(l1, "doc_1", "https://example.com/1", 1, ngx_time() + 60);
+
+    ngx_str_t k = key("doc_1");
+    ngx_uint_t i, hits, reported = 0;
+    for (i = 0; i < 2 * CL1_REPORT_HITS + 1; ++i)
+    {
+        T_OK(ngx_http_clcache_l1_get(l1, NULL, &k, NVALUES, 1, &hits) != NULL);
+        T_OK(hits == 0 || hits == CL1_REPORT_HITS);
+        reported += hits;
+    }
+    T_OK(reported == 2 * CL1_REPORT_HITS);
+}
+
+static void test_lru(void)
+{
+    // A single set of CL1_WAYS records
+    ngx_http_clcache_l1_s *l1 = ngx_http_clcache_l1_create(NULL, CL1_WAYS);
+    T_OK(l1->mask == 0);
+
+    char k[CL1_WAYS + 1][8];
+    ngx_uint_t i;
+    for (i = 0; i <= CL1_WAYS; ++i)
+        snprintf(k[i], sizeof (k[i]), "doc_%u", (unsigned)i);
+    for (i = 0; i < CL1_WAYS; ++i)
+        put(l1, k[i], "https://example.com/", 1, ngx_time() + 60);
+
+    // The least recently used record is replaced
+    T_OK(get(l1, k[0], 1) != NULL);
+    put(l1, k[CL1_WAYS], "https://example.com/", 1, ngx_time() + 60);
+    T_OK(get(l1, k[0], 1) != NULL);
+    T_OK(get(l1, k[1], 1) == NULL);
+    for (i = 2; i <= CL1_WAYS; ++i)
+        T_OK(get(l1, k[i], 1) != NULL);
+}
+
+int main(void)
+{
+    test_get();
+    test_hits();
+    test_lru();
+
+    T_DONE();
+}
@@ -0,0 +1,81 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_http_clhedge.h"
+#include "t.h"
+
+static void test_delay(void)
+{
+    T_OK(ngx_http_clhedge_delay(ngx_http_clhedge_create(NULL, 20, 5)) == 20000);
+
+    // Derived from the p95, once enough round trips were observed
+    ngx_http_clhedge_s *h = ngx_http_clhedge_create(NULL, 0, 5);
+    ngx_uint_t i;
+    for (i = 0; i < CLH_MIN_SAMPLES - 1; ++i)
+        ngx_http_clhedge_observe(h, 1000);
+    T_OK(ngx_http_clhedge_delay(h) == 0);
+    ngx_http_clhedge_observe(h, 1000);
+    T_OK(ngx_http_clhedge_delay(h) == 1024); // upper bound of the bucket of 1ms
+
+    // 10% of slow round trips move the p95 into their bucket
+    for (i = 0; i < CLH_MIN_SAMPLES / 9 + 1; ++i)
+        ngx_http_clhedge_observe(h, 100000);
+    T_OK(ngx_http_clhedge_delay(h) == 131072);
+
+    // Slower than the histogram, bounded by its last bucket
+    h = ngx_http_clhedge_create(NULL, 0, 5);
+    for (i = 0; i < CLH_MIN_SAMPLES; ++i)
+        ngx_http_clhedge_observe(h, 60000000);
+    T_OK(ngx_http_clhedge_delay(h) == 1 << (CLH_BUCKETS - 1 + CLH_BUCKET_MIN_BITS));
+}
+
+static void test_budget(void)
+{
+    ngx_http_clhedge_s *h = ngx_http_clhedge_create(NULL, 20, 5);
+    T_OK(ngx_http_clhedge_reserve(h) == 0);
+
+    ngx_http_clhedge_count(h, 100);
+    ngx_uint_t i;
+    for (i = 0; i < 5; ++i)
+        T_OK(ngx_http_clhedge_reserve(h) == 1);
+    T_OK(ngx_http_clhedge_reserve(h) == 0);
+    T_OK(h->hedges == 5);
+
+    // Given back when the hedged request could not be sent
+    ngx_http_clhedge_release(h);
+    T_OK(ngx_http_clhedge_reserve(h) == 1);
+
+    // Never below 0, e.g. released after an aging
+    h = ngx_http_clhedge_create(NULL, 20, 5);
+    ngx_http_clhedge_release(h);
+    T_OK(h->hedges == 0);
+}
+
+static void test_aging(void)
+{
+    ngx_http_clhedge_s *h = ngx_http_clhedge_create(NULL, 0, 5);
+    ngx_http_clhedge_count(h, 101);
+    ngx_uint_t i;
+    for (i = 0; i < 5; ++i)
+        T_OK(ngx_http_clhedge_reserve(h) == 1);
+
+    for (i = 0; i < CLH_WINDOW; ++i)
+        ngx_http_clhedge_observe(h, 1000);
+    T_OK(h->samples == 0);
+    T_OK(h->lookups == 50);
+    T_OK(h->hedges == 2);
+
+    ngx_atomic_uint_t total = 0;
+    for (i = 0; i < CLH_BUCKETS; ++i)
+        total += h->hist[i];
+    T_OK(total == CLH_WINDOW / 2);
+    T_OK(ngx_http_clhedge_delay(h) == 1024);
+}
+
+int main(void)
+{
+    test_delay();
+    test_budget();
+    test_aging();
+
+    T_DONE();
+}
@@ -0,0 +1,97 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_http_cljson.h"
+#include "t.h"
+
+static ngx_str_t string(const char *json)
+{
+    ngx_str_t value = ngx_null_string;
+    T_OK(ngx_http_cljson_string(NULL, (u_char *)json, strlen(json), &value) == NGX_OK);
+    return value;
+}
+
+static ngx_str_t primitive(const char *json)
+{
+    ngx_str_t value = ngx_null_string;
+    T_OK(ngx_http_cljson_primitive(NULL, (u_char *)json, strlen(json), &value) == NGX_OK);
+    return value;
+}
+
+static void test_strings(void)
+{
+    // Nothing to decode, the value points into the document
+    const char *plain = "https://example.com/a";
+    ngx_str_t value = string(plain);
+    T_OK(value.data == (u_char *)plain);
+    T_STR(value, "https://example.com/a");
+
+    T_STR(string("a\\\"b\\\\c\\/d"), "a\"b\\c/d");
+    T_STR(string("caf\\u00e9"), "caf\xc3\xa9");
+    T_STR(string("\\u20ac"), "\xe2\x82\xac");
+    T_STR(string("\\ud83d\\ude00"), "\xf0\x9f\x98\x80");
+
+    // Lone surrogates
+    T_STR(string("\\ud83dx"), "\xef\xbf\xbdx");
+    T_STR(string("\\ude00"), "\xef\xbf\xbd");
+
+    // Control characters stay escaped, values can reach response headers
+    T_STR(string("a\\nb\\r\\n"), "a\\nb\\r\\n");
+    T_STR(string("\\u0000\\u001f"), "\\u0000\\u001f");
+    T_STR(string("\\t\\b\\f"), "\\t\\b\\f");
+
+    // Invalid or truncated sequences are kept as is
+    T_STR(string("\\uzzzz"), "\\uzzzz");
+    T_STR(string("\\u12"), "\\u12");
+    T_STR(string("a\\"), "a\\");
+}
+
+static void test_primitives(void)
+{
+    T_STR(primitive("true"), "1");
+    T_STR(primitive("false"), "0");
+    T_OK(primitive("null").data == NULL);
+
+    T_STR(primitive("42"), "42");
+    T_STR(primitive("-7"), "-7");
+    T_STR(primitive("1.50"), "1.5");
+    T_STR(primitive("1.0"), "1");
+    T_STR(primitive("0.0"), "0");
+    T_STR(primitive("-0.0e5"), "0");
+    T_STR(primitive("1.5e0"), "1.5");
+    T_STR(primitive("1e+05"), "1e5");
+    T_STR(primitive("2.50E-02"), "2.5e-2");
+
+    // Not JSON numbers, kept as is
+    T_STR(primitive("012"), "012");
+    T_STR(primitive("1."), "1.");
+    T_STR(primitive("1e"), "1e");
+    T_STR(primitive("0x10"), "0x10");
+}
+
+static void test_values(void)
+{
+    char doc[] = "{\"url\":\"a\\u0041\",\"on\":true,\"ids\":[1, 2],\"n\":null}";
+    jsmn_parser parser;
+    jsmntok_t tokens[16];
+    jsmn_init(&parser);
+    T_OK(jsmn_parse(&parser, doc, strlen(doc), tokens, 16) == 11);
+
+    ngx_str_t value;
+    T_OK(ngx_http_cljson_value(NULL, (u_char *)doc, &tokens[2], &value) == NGX_OK);
+    T_STR(value, "aA");
+    T_OK(ngx_http_cljson_value(NULL, (u_char *)doc, &tokens[4], &value) == NGX_OK);
+    T_STR(value, "1");
+    T_OK(ngx_http_cljson_value(NULL, (u_char *)doc, &tokens[6], &value) == NGX_OK);
+    T_STR(value, "[1, 2]");
+    T_OK(ngx_http_cljson_value(NULL, (u_char *)doc, &tokens[10], &value) == NGX_OK);
+    T_OK(value.data == NULL);
+}
+
+int main(void)
+{
+    test_strings();
+    test_primitives();
+    test_values();
+
+    T_DONE();
+}
@@ -0,0 +1,98 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_http_cllimit.h"
+#include "t.h"
+
+#define LATENCY (50)
+
+static ngx_http_cllimit_node_s *node(ngx_http_cllimit_s *l, const char *name, ngx_uint_t max)
+{
+    ngx_str_t s = { .data = (u_char *)name, .len = strlen(name) };
+    return ngx_http_cllimit_node(l, NULL, &s, max);
+}
+
+static void test_nodes(void)
+{
+    ngx_http_cllimit_s *l = ngx_http_cllimit_create(NULL);
+    ngx_http_cllimit_node_s *a = node(l, "10.0.0.1:11210", 8);
+    T_OK(a != NULL && a->limit == 8 * CLL_SCALE);
+    T_OK(node(l, "10.0.0.1:11210", 4) == a);
+    T_OK(node(l, "10.0.0.2:11210", 8) != a);
+    T_OK(node(l, "", 8) != a);
+    T_OK(node(l, "", 8) == node(l, "", 8));
+}
+
+static void test_acquire(void)
+{
+    ngx_http_cllimit_s *l = ngx_http_cllimit_create(NULL);
+    ngx_http_cllimit_node_s *n = node(l, "a", 4);
+    ngx_uint_t i;
+    for (i = 0; i < 4; ++i)
+        T_OK(ngx_http_cllimit_acquire(n, 4) == NGX_OK);
+    T_OK(ngx_http_cllimit_acquire(n, 4) == NGX_BUSY);
+
+    // Bound of the lookup, whatever the limit
+    ngx_http_cllimit_cancel(n);
+    T_OK(ngx_http_cllimit_acquire(n, 2) == NGX_BUSY);
+    T_OK(ngx_http_cllimit_acquire(n, 4) == NGX_OK);
+    T_OK(n->inflight == 4 && n->limit == 4 * CLL_SCALE);
+}
+
+static void test_aimd(void)
+{
+    ngx_http_cllimit_s *l = ngx_http_cllimit_create(NULL);
+    ngx_http_cllimit_node_s *n = node(l, "a", 8);
+    ngx_current_msec = 1000;
+
+    // Slow round trips halve the limit, once per latency period
+    T_OK(ngx_http_cllimit_acquire(n, 8) == NGX_OK);
+    T_OK(ngx_http_cllimit_acquire(n, 8) == NGX_OK);
+    ngx_http_cllimit_release(n, LATENCY + 1, 0, 8, LATENCY);
+    T_OK(n->limit == 4 * CLL_SCALE);
+    ngx_http_cllimit_release(n, 0, 1, 8, LATENCY);
+    T_OK(n->limit == 4 * CLL_SCALE);
+
+    ngx_current_msec += LATENCY;
+    T_OK(ngx_http_cllimit_acquire(n, 8) == NGX_OK);
+    ngx_http_cllimit_release(n, 0, 1, 8, LATENCY);
+    T_OK(n->limit == 2 * CLL_SCALE);
+
+    // Never under one lookup
+    ngx_uint_t i;
+    for (i = 0; i < 4; ++i)
+    {
+        ngx_current_msec += LATENCY;
+        T_OK(ngx_http_cllimit_acquire(n, 8) == NGX_OK);
+        ngx_http_cllimit_release(n, 0, 1, 8, LATENCY);
+    }
+    T_OK(n->limit == CLL_SCALE);
+
+    // Fast ones add about one lookup per window
+    T_OK(ngx_http_cllimit_acquire(n, 8) == NGX_OK);
+    ngx_http_cllimit_release(n, LATENCY, 0, 8, LATENCY);
+    T_OK(n->limit == 2 * CLL_SCALE);
+    T_OK(ngx_http_cllimit_acquire(n, 8) == NGX_OK);
+    ngx_http_cllimit_release(n, 1, 0, 8, LATENCY);
+    T_OK(n->limit == 2 * CLL_SCALE + CLL_SCALE / 2);
+
+    // Up to the bound, never lowered by a location with a smaller one
+    for (i = 0; i < 100; ++i)
+    {
+        T_OK(ngx_http_cllimit_acquire(n, 8) == NGX_OK);
+        ngx_http_cllimit_release(n, 1, 0, 8, LATENCY);
+    }
+    T_OK(n->limit == 8 * CLL_SCALE);
+    T_OK(ngx_http_cllimit_acquire(n, 2) == NGX_OK);
+    ngx_http_cllimit_release(n, 1, 0, 2, LATENCY);
+    T_OK(n->limit == 8 * CLL_SCALE);
+    T_OK(n->inflight == 0);
+}
+
+int main(void)
+{
+    test_nodes();
+    test_acquire();
+    test_aimd();
+
+    T_DONE();
+}
@@ -0,0 +1,248 @@
+#!/usr/bin/env python3
+"""Replays a captured trace of lookups against nginx, and reports how the
+couchlookup cache policy of the replayed locations performed.
+
+Trace lines are `TIMESTAMP KEY` (e.g. `$msec $uri` from an access log). Each
+key is requested from `--url`, `{key}` being replaced by the key, one at a
+time in trace order and at the pace of the trace. Results are read from the
+access log of the replayed locations, in the `couchlookup_replay` log format
+(see README).
+
+    couchlookup_replay.py seed  --trace keys.log --couchbase http://127.0.0.1:8091 ...
+    couchlookup_replay.py run   --trace keys.log --url http://127.0.0.1:8080/lookup/{key} \\
+                                --log /var/log/nginx/replay.log --label cache-5m
+"""
+
+import argparse
+import base64
+import json
+import math
+import os
+import queue
+import sys
+import threading
+import time
+import urllib.error
+import urllib.parse
+import urllib.request
+
+# Fields of the `couchlookup_replay` log format, in order
+LOG_FIELDS = ("cache_status", "status", "time", "doc_bytes", "ops")
+
+PERCENTILES = (50, 90, 99, 99.9)
+
+
+def read_trace(path, limit=None):
+    """Returns the (timestamp, key) pairs of a trace, in file order."""
+    trace = []
+    with open(path) as f:
+        for n, line in enumerate(f, 1):
+            line = line.strip()
+            if not line or line.startswith("#"):
+                continue
+            fields = line.split(None, 1)
+            if len(fields) != 2:
+                sys.exit("%s:%d: expecting `TIMESTAMP KEY`" % (path, n))
+            trace.append((float(fields[0]), fields[1]))
+            if limit is not None and len(trace) == limit:
+                break
+    return trace
+
+
+def percentile(values, p):
+    """Nearest-rank percentile of sorted values."""
+    if not values:
+        return 0.0
+    rank = max(1, math.ceil(p / 100.0 * len(values)))
+    return values[min(rank, len(values)) - 1]
+
+
+def seed(args):
+    """Writes a synthetic document for each distinct key of the trace, through
+    the document REST API of a local Couchbase (the document store stand-in)."""
+    keys = sorted({key for _, key in read_trace(args.trace)})
+    auth = base64.b64encode(("%s:%s" % (args.username, args.password)).encode()).decode()
+    padding = "x" * max(0, args.doc_size - 64)
+
+    for i, key in enumerate(keys):
+        doc_key = args.key_format.format(key=key)
+        doc = json.dumps({"type": "redirect", "url": "https://example.com/%d" % i, "pad": padding})
+        url = "%s/pools/default/buckets/%s/docs/%s" % (
+            args.couchbase, args.bucket, urllib.parse.quote(doc_key, safe=""))
+        body = urllib.parse.urlencode({"value": doc}).encode()
+        req = urllib.request.Request(url, data=body, headers={"Authorization": "Basic " + auth})
+        urllib.request.urlopen(req).read()
+
+    print("seeded %d documents of about %d bytes" % (len(keys), args.doc_size))
+
+
+def worker_rss(master_pid):
+    """Sum of the resident memory of the children of the nginx master, in bytes."""
+    try:
+        with open("/proc/%d/task/%d/children" % (master_pid, master_pid)) as f:
+            pids = [int(pid) for pid in f.read().split()]
+    except OSError:
+        return None
+
+    rss = 0
+    for pid in pids:
+        try:
+            with open("/proc/%d/status" % pid) as f:
+                for line in f:
+                    if line.startswith("VmRSS:"):
+                        rss += int(line.split()[1]) * 1024
+        except OSError:
+            pass
+    return rss
+
+
+def replay(trace, args):
+    """Requests the keys of the trace, returns client-side latencies in seconds.
+    Requests are dispatched in trace order, by `--concurrency` threads: with
+    more than one, consecutive requests can be served out of order."""
+    jobs = queue.Queue(maxsize=args.concurrency * 4)
+    latencies = []
+    errors = [0]
+    lock = threading.Lock()
+
+    def run():
+        while True:
+            key = jobs.get()
+            if key is None:
+                return
+            url = args.url.replace("{key}", urllib.parse.quote(key, safe="/"))
+            start = time.monotonic()
+            try:
+                urllib.request.urlopen(url, timeout=args.timeout).read()
+            except urllib.error.HTTPError:
+                pass  # 404 and the like are lookups too, logged by nginx
+            except (urllib.error.URLError, OSError):
+                with lock:
+                    errors[0] += 1
+            with lock:
+                latencies.append(time.monotonic() - start)
+
+    threads = [threading.Thread(target=run) for _ in range(args.concurrency)]
+    for t in threads:
+        t.start()
+
+    # Open loop, paced on the trace timestamps (as fast as possible with speed 0)
+    origin = trace[0][0] if trace else 0
+    started = time.monotonic()
+    for ts, key in trace:
+        if args.speed > 0:
+            delay = (ts - origin) / args.speed - (time.monotonic() - started)
+            if delay > 0:
+                time.sleep(delay)
+        jobs.put(key)
+
+    for _ in threads:
+        jobs.put(None)
+    for t in threads:
+        t.join()
+
+    return sorted(latencies), errors[0], time.monotonic() - started
+
+
+def read_log(path, offset):
+    """Returns the `couchlookup_replay` entries appended to a log since `offset`."""
+    entries = []
+    with open(path) as f:
+        f.seek(offset)
+        for line in f:
+            fields = line.split()
+            if len(fields) != len(LOG_FIELDS):
+                continue
+            entries.append(dict(zip(LOG_FIELDS, fields)))
+    return entries
+
+
+def run(args):
+    trace = read_trace(args.trace, args.limit)
+    if not trace:
+        sys.exit("empty trace")
+
+    offset = os.path.getsize(args.log)
+    latencies, errors, elapsed = replay(trace, args)
+    time.sleep(args.log_delay)  # access logs can be buffered
+    entries = read_log(args.log, offset)
+
+    counts = {}
+    for e in entries:
+        counts[e["cache_status"]] = counts.get(e["cache_status"], 0) + 1
+    lookups = len(entries)
+    hits = counts.get("HIT", 0) + counts.get("L1", 0)
+    couch_ops = sum(int(e["ops"]) for e in entries if e["ops"].isdigit())
+    couch_times = sorted(float(e["time"]) for e in entries if e["time"] not in ("-", ""))
+    rss = worker_rss(args.nginx_pid) if args.nginx_pid else None
+
+    report = [
+        ("label", args.label),
+        ("requests", len(trace)),
+        ("errors", errors),
+        ("elapsed_s", "%.1f" % elapsed),
+        ("lookups", lookups),
+        ("hit_ratio", "%.4f" % (hits / lookups if lookups else 0)),
+    ]
+    report += [("status_" + s.lower(), counts.get(s, 0))
+               for s in ("HIT", "L1", "STALE", "MISS", "BYPASS")]
+    report.append(("couch_ops", couch_ops))
+    report += [("couch_p%g_ms" % p, "%.3f" % (percentile(couch_times, p) * 1000))
+               for p in PERCENTILES]
+    report += [("client_p%g_ms" % p, "%.3f" % (percentile(latencies, p) * 1000))
+               for p in PERCENTILES]
+    report.append(("worker_rss_mb", "%.1f" % (rss / 1048576.0) if rss is not None else "-"))
+
+    if lookups != len(trace):
+        print("warning: %d requests but %d log entries, check the log format and location"
+              % (len(trace), lookups), file=sys.stderr)
+
+    if args.csv:
+        new = not os.path.exists(args.csv)
+        with open(args.csv, "a") as f:
+            if new:
+                f.write(",".join(k for k, _ in report) + "\n")
+            f.write(",".join(str(v) for _, v in report) + "\n")
+
+    width = max(len(k) for k, _ in report)
+    for k, v in report:
+        print("%-*s  %s" % (width, k, v))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    p = sub.add_parser("seed", help="write a document for each key of the trace")
+    p.add_argument("--trace", required=True)
+    p.add_argument("--couchbase", default="http://127.0.0.1:8091", help="REST API of the cluster")
+    p.add_argument("--bucket", required=True)
+    p.add_argument("--username", required=True)
+    p.add_argument("--password", required=True)
+    p.add_argument("--key-format", default="{key}",
+                   help="couchbase key of a trace key, as in couchlookup_read_doc (e.g. doc_{key})")
+    p.add_argument("--doc-size", type=int, default=512, help="approximate document size in bytes")
+    p.set_defaults(func=seed)
+
+    p = sub.add_parser("run", help="replay the trace and report")
+    p.add_argument("--trace", required=True)
+    p.add_argument("--url", required=True, help="request URL, {key} is replaced by the trace key")
+    p.add_argument("--log", required=True, help="access log in the couchlookup_replay format")
+    p.add_argument("--label", default="default", help="name of the cache policy being replayed")
+    p.add_argument("--speed", type=float, default=1.0,
+                   help="replay speed factor, 0 for as fast as possible (TTLs are not scaled)")
+    p.add_argument("--concurrency", type=int, default=1,
+                   help="requests in flight, above 1 the trace order is not kept")
+    p.add_argument("--timeout", type=float, default=5.0)
+    p.add_argument("--limit", type=int, help="only replay the first lines of the trace")
+    p.add_argument("--nginx-pid", type=int, help="master pid, to report the workers' memory")
+    p.add_argument("--log-delay", type=float, default=1.0, help="seconds to wait for the log")
+    p.add_argument("--csv", help="append the report to this CSV file, one row per policy")
+    p.set_defaults(func=run)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()